@@ -0,0 +1,212 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+#include "calibration.hpp"
+#include "schedule.hpp"
+#include "timer.hpp"
+#include "utils.hpp"
+
+// Memory at the peak of a schedule by kind: resident inputs (`already_on`), persistent outputs (`not_dealloc`),
+// transient activations and the workspace of the peak task, the rest are buffers of gradient all-reduces
+struct MemoryBreakdown {
+    size_t peak_memory = 0;
+    uint64_t total_time = 0;
+    MemoryProfile profile;
+    std::string peak_task = "none";
+    size_t resident = 0, persistent = 0, transient = 0, workspace = 0, communication = 0;
+
+    static MemoryBreakdown fromSchedule(const ScheduleHandle &schedule) {
+        auto &common = *schedule->common;
+        MemoryBreakdown breakdown;
+        breakdown.total_time = common.analyzeTime(schedule->head);
+        breakdown.peak_memory = common.analyzeMemory(schedule->head, breakdown.profile, true);
+        for (auto &operand: breakdown.profile.live) {
+            if (common.already_on.count(operand)) {
+                breakdown.resident += operand->size;
+            } else if (common.not_dealloc.count(operand)) {
+                breakdown.persistent += operand->size;
+            } else {
+                breakdown.transient += operand->size;
+            }
+        }
+        LOOP(task, schedule->head) {
+            if (task->time_stamp == breakdown.profile.peak.time_stamp) {
+                breakdown.peak_task = task->name;
+                breakdown.workspace = task->workspace;
+            }
+        }
+        breakdown.communication = breakdown.profile.peak.memory - breakdown.resident - breakdown.persistent - breakdown.transient - breakdown.workspace;
+        return breakdown;
+    }
+};
+
+// Analyzes a pattern once without searching, e.g. to gate memory regressions
+class Analysis {
+    static constexpr int DEFAULT_TOP = 10;
+
+    size_t limit = 0;
+    int top = DEFAULT_TOP, threads = 0;
+    // Compares the analyses on `threads` with a single thread, a debugging aid costing two more analyses
+    bool check_threads = false;
+    double percentile = 50;
+    std::string calibration, data_parallel;
+
+    // Everything the analyses write: time stamps, memory, def-use chains, versions, frees and the profile
+    static size_t fingerprint(const ScheduleHandle &schedule, const MemoryBreakdown &breakdown) {
+        size_t value = 0;
+        auto mix = [&value](size_t item) {
+            value ^= item + 0x9e3779b97f4a7c15ull + (value << 6u) + (value >> 2u);
+        };
+        auto stamp = [](const TaskHandle &task) {
+            return task ? task->time_stamp : -1;
+        };
+        mix(breakdown.peak_memory), mix(breakdown.total_time);
+        LOOP(task, schedule->head) {
+            mix(task->time_stamp), mix(task->execution_memory);
+            for (auto *usages: {&task->ins, &task->outs}) {
+                for (auto &usage: *usages) {
+                    mix(usage.version), mix(stamp(usage.gen)), mix(stamp(usage.next_gen));
+                    mix(stamp(usage.prev_use)), mix(stamp(usage.next_use)), mix(stamp(usage.last_use));
+                }
+            }
+            for (auto &operand: task->to_dealloc_after) {
+                mix(operand->id);
+            }
+        }
+        auto &profile = breakdown.profile;
+        for (auto &peak: profile.peaks) {
+            mix(peak.time_stamp), mix(peak.memory);
+        }
+        for (auto &region: profile.regions) {
+            mix(region.begin), mix(region.end), mix(region.peak.time_stamp);
+            for (auto &operand: region.dominating) {
+                mix(operand->id);
+            }
+        }
+        for (auto &operand: profile.live) {
+            mix(operand->id);
+        }
+        return value;
+    }
+
+    static const char* kind(const Common &common, const OperandHandle &operand) {
+        if (common.already_on.count(operand)) {
+            return "resident";
+        }
+        return common.not_dealloc.count(operand) ? "persistent" : "transient";
+    }
+
+public:
+    static Analysis fromArguments(const std::vector<std::string> &arguments) {
+        Analysis analysis;
+        for (auto &argument: arguments) {
+            auto pos = argument.find('=');
+            auto key = argument.substr(0, pos);
+            auto value = pos == std::string::npos ? "" : argument.substr(pos + 1);
+            if (key == "--limit") {
+                analysis.limit = Unit::fromText(value);
+            } else if (key == "--top") {
+                analysis.top = std::stoi(value);
+                if (analysis.top < 0) {
+                    error("Count of listed operands should be non-negative\n");
+                }
+            } else if (key == "--percentile") {
+                analysis.percentile = std::stod(value);
+                if (analysis.percentile < 50 or analysis.percentile >= 100) {
+                    error("Percentile should be in [50, 100)\n");
+                }
+            } else if (key == "--threads") {
+                analysis.threads = std::stoi(value);
+                if (analysis.threads < 0) {
+                    error("Thread count should be non-negative\n");
+                }
+            } else if (key == "--check-threads") {
+                analysis.check_threads = true;
+            } else if (key == "--calibration") {
+                analysis.calibration = value;
+            } else if (key == "--data-parallel") {
+                analysis.data_parallel = value;
+            } else {
+                error("Unknown option %s\n", argument.c_str());
+            }
+        }
+        return analysis;
+    }
+
+    // Returns whether the peak is within the limit (always without one)
+    bool run(const std::string &input) const {
+        Timer timer;
+        ScheduleHandle schedule;
+        int count;
+        std::tie(schedule, count) = Schedule::fromFile(input);
+        uint64_t load_time = timer.tik();
+        auto &common = *schedule->common;
+        common.time_z = normalQuantile(percentile / 100);
+        if (not calibration.empty()) {
+            Calibration::fromFile(calibration).apply(schedule);
+        }
+        if (not data_parallel.empty()) {
+            auto model = DataParallel::fromFile(data_parallel, common.operands, common.aliases, schedule->head);
+            common.parallel = std::make_shared<DataParallel>(model);
+        }
+        common.threads = threads;
+        auto breakdown = MemoryBreakdown::fromSchedule(schedule);
+        uint64_t analysis_time = timer.tik();
+
+        // The analyses are the same for any count of threads
+        if (check_threads) {
+            auto single = schedule->copy();
+            common.threads = 1;
+            auto expected = fingerprint(single, MemoryBreakdown::fromSchedule(single));
+            common.threads = threads;
+            auto result = fingerprint(schedule, MemoryBreakdown::fromSchedule(schedule));
+            if (result != expected) {
+                error("Analysis with %d threads differs from a single thread\n", threads);
+            }
+        }
+
+        // Report
+        auto &profile = breakdown.profile;
+        printf("Analyzing %s (%d operators) ... \n", input.c_str(), count);
+        printf(" > Peak memory: %s (#%d, %s)\n", prettyBytes(breakdown.peak_memory).c_str(), profile.peak.time_stamp,
+               breakdown.peak_task.c_str());
+        printf(" > Total time: %s\n", prettyNanoseconds(breakdown.total_time).c_str());
+        if (percentile != 50) {
+            printf(" > Total time is at P%g\n", percentile);
+        }
+        printf(" > Breakdown at the peak:\n");
+        auto line = [&breakdown](const char *name, size_t size) {
+            double ratio = breakdown.peak_memory ? 100.0 * size / breakdown.peak_memory : 0;
+            printf("   > %-22s %s (%.2f%%)\n", name, prettyBytes(size).c_str(), ratio);
+        };
+        line("Resident inputs:", breakdown.resident);
+        line("Persistent outputs:", breakdown.persistent);
+        line("Transient activations:", breakdown.transient);
+        line("Workspace:", breakdown.workspace);
+        if (common.parallel) {
+            line("Communication buffers:", breakdown.communication);
+        }
+        std::string peaks;
+        for (auto &peak: profile.peaks) {
+            peaks += (peaks.empty() ? "#" : ", #") + std::to_string(peak.time_stamp) + ": " + prettyBytes(peak.memory);
+        }
+        printf(" > Top peaks: {%s}\n", peaks.c_str());
+        printf(" > Largest live operands at the peak (%zu live):\n", profile.live.size());
+        for (int i = 0; i < std::min<int>(top, profile.live.size()); ++ i) {
+            auto &operand = profile.live[i];
+            std::string shape = operand->attr.count("shape") ? ", shape " + operand->attr["shape"].dump() : "";
+            printf("   > #%d: %s, %s%s\n", operand->id, prettyBytes(operand->size).c_str(), kind(common, operand), shape.c_str());
+        }
+        if (check_threads) {
+            printf(" > Same analysis on a single thread: true\n");
+        }
+        printf(" > Time used: %s (loading %s)\n", prettyNanoseconds(load_time + analysis_time).c_str(),
+               prettyNanoseconds(load_time).c_str());
+        if (limit > 0) {
+            printf(" > Within limit %s: %s\n", prettyBytes(limit).c_str(), breakdown.peak_memory <= limit ? "true" : "false");
+        }
+        return limit == 0 or breakdown.peak_memory <= limit;
+    }
+};
@@ -0,0 +1,170 @@
+#pragma once
+
+#include <algorithm>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "optimizer.hpp"
+#include "runner.hpp"
+#include "scaling.hpp"
+#include "schedule.hpp"
+#include "timer.hpp"
+#include "utils.hpp"
+
+struct BatchProbe {
+    int batch = 0;
+    bool feasible = false, bounded = false;
+    size_t peak_memory = 0;
+    uint64_t origin_time = 0, total_time = 0, used_time = 0;
+};
+
+// Binary search of the largest batch fitting the limit within a slowdown, the optimizer in the loop. The schedule is
+// loaded and analyzed once, every probe scales a copy of it
+class BatchSearch {
+    static constexpr int MAX_DOUBLINGS = 16;
+
+    size_t limit;
+    double slowdown;
+    int base;
+    Options options;
+
+    ScheduleHandle schedule;
+    BatchScaling scaling;
+    std::map<int, BatchProbe> probes;
+    std::map<int, Optimizer::Result> results;
+
+    bool probe(int batch) {
+        if (probes.count(batch)) {
+            return probes[batch].feasible;
+        }
+        Timer timer;
+        auto &probe = probes[batch];
+        probe.batch = batch;
+        if (scaling.lowerBound(schedule, batch) > limit) {
+            probe.bounded = true;
+            printf(" > Batch %d: bounded, a single task does not fit\n", batch);
+            return false;
+        }
+        auto result = Runner::optimize(scaling.apply(schedule, batch), limit, options);
+        probe.origin_time = result.origin->analyze().second;
+        probe.peak_memory = result.best->peak_memory;
+        probe.total_time = result.best->total_time;
+        probe.feasible = result.satisfied and probe.total_time <= (1 + slowdown) * probe.origin_time;
+        probe.used_time = timer.tik();
+        printf(" > Batch %d: %s, slowdown %.2f%% (%d searched, %s) -> %s\n", batch, result.best->info().c_str(),
+               (static_cast<double>(probe.total_time) / probe.origin_time - 1) * 100, result.count,
+               prettyNanoseconds(probe.used_time).c_str(), probe.feasible ? "feasible" : "infeasible");
+        if (probe.feasible) {
+            results[batch] = result;
+        }
+        return probe.feasible;
+    }
+
+public:
+    BatchSearch(size_t limit, double slowdown, int base=0, const Options &options=Options()):
+        limit(limit), slowdown(slowdown), base(base), options(options) {
+        this->options.verbose = false;
+    }
+
+    static BatchSearch fromArguments(size_t limit, const std::vector<std::string> &arguments) {
+        double slowdown = 0.1;
+        int base = 0;
+        std::vector<std::string> rest;
+        for (auto &argument: arguments) {
+            auto pos = argument.find('=');
+            auto key = argument.substr(0, pos);
+            auto value = pos == std::string::npos ? "" : argument.substr(pos + 1);
+            if (key == "--slowdown") {
+                slowdown = std::stod(value);
+                if (slowdown < 0) {
+                    error("Slowdown should be non-negative\n");
+                }
+            } else if (key == "--base-batch") {
+                base = std::stoi(value);
+                if (base < 1) {
+                    error("Base batch size should be positive\n");
+                }
+            } else {
+                rest.push_back(argument);
+            }
+        }
+        auto options = Options::fromArguments(rest);
+        if (options.stream > 0) {
+            error("Streaming is not supported while searching the batch size\n");
+        }
+        return BatchSearch(limit, slowdown, base, options);
+    }
+
+    // Returns the largest feasible batch, 0 if even a batch of one does not fit
+    int search(const ScheduleHandle &origin) {
+        schedule = origin;
+        scaling = BatchScaling::infer(schedule, base);
+        probes.clear();
+        results.clear();
+        printf(" > Base batch %d, %d of %zu operands scale with it\n", scaling.base, scaling.count(), scaling.scaled.size());
+
+        // Double from the base until infeasible (or halve until feasible), then bisect
+        int low = 0, high = 0;
+        if (probe(scaling.base)) {
+            low = scaling.base;
+            for (int i = 0; i < MAX_DOUBLINGS and not high; ++ i) {
+                if (probe(low * 2)) {
+                    low *= 2;
+                } else {
+                    high = low * 2;
+                }
+            }
+            if (not high) {
+                warning("Still feasible at batch %d, stop doubling\n", low);
+                high = low + 1;
+            }
+        } else {
+            high = scaling.base;
+            while (high > 1 and not probe(high / 2)) {
+                high /= 2;
+            }
+            low = high / 2;
+        }
+        while (high - low > 1) {
+            int middle = low + (high - low) / 2;
+            if (probe(middle)) {
+                low = middle;
+            } else {
+                high = middle;
+            }
+        }
+        return low;
+    }
+
+    void run(const std::string &input, const std::string &output) {
+        Timer timer;
+        ScheduleHandle origin;
+        int count;
+        std::tie(origin, count) = Schedule::fromFile(input);
+        printf("Searching the maximum batch of %s (%d operators) within %s and %.2f%% slowdown ... \n", input.c_str(), count,
+               prettyBytes(limit).c_str(), slowdown * 100);
+        int batch = search(origin);
+        int bounded = std::count_if(probes.begin(), probes.end(), [](const std::pair<const int, BatchProbe> &item) {
+            return item.second.bounded;
+        });
+        printf(" > Result:\n");
+        printf("   > Batches probed: %zu (%d bounded without searching)\n", probes.size(), bounded);
+        printf("   > Time used: %s\n", prettyNanoseconds(timer.tik()).c_str());
+        if (batch == 0) {
+            printf("   > No batch fits\n");
+            scaling.resize(*origin->common, scaling.base);
+            return;
+        }
+        auto &probe = probes[batch];
+        printf("   > Maximum batch: %d (peak memory: %s, total time: %s, slowdown %.2f%%)\n", batch,
+               prettyBytes(probe.peak_memory).c_str(), prettyNanoseconds(probe.total_time).c_str(),
+               (static_cast<double>(probe.total_time) / probe.origin_time - 1) * 100);
+
+        // Operand sizes and shapes are shared, the plan is written at its own batch
+        scaling.resize(*origin->common, batch);
+        printf(" > Writing result into path %s ... ", output.c_str());
+        results[batch].best->restoreAndDumpToFile(output);
+        printf("OK!\n");
+    }
+};
@@ -0,0 +1,73 @@
+#pragma once
+
+#include <fstream>
+#include <map>
+#include <string>
+
+#include "json.hpp"
+#include "schedule.hpp"
+#include "utils.hpp"
+
+// Per-operator correction factors fitted from the profile of an optimized run (see `processor.py calibrate`)
+struct Calibration {
+    struct Factor {
+        double original = 1, recomputed = 1;
+    };
+
+    std::map<std::string, Factor> time, workspace;
+
+    static Calibration fromFile(const std::string &path) {
+        std::ifstream file(path);
+        if (not file) {
+            error("Failed to open calibration file %s\n", path.c_str());
+        }
+        nlohmann::json json;
+        file >> json;
+
+        auto read = [](const nlohmann::json &json, std::map<std::string, Factor> &factors) {
+            for (auto it = json.begin(); it != json.end(); ++ it) {
+                auto &factor = factors[it.key()];
+                factor.original = it.value().value("original", 1.0);
+                factor.recomputed = it.value().value("recomputed", factor.original);
+            }
+        };
+        Calibration calibration;
+        if (json.count("time")) {
+            read(json["time"], calibration.time);
+        }
+        if (json.count("workspace")) {
+            read(json["workspace"], calibration.workspace);
+        }
+        return calibration;
+    }
+
+    Factor timeFactor(const std::string &name) const {
+        return time.count(name) ? time.at(name) : Factor();
+    }
+
+    Factor workspaceFactor(const std::string &name) const {
+        return workspace.count(name) ? workspace.at(name) : Factor();
+    }
+
+    // Apply corrections on a loaded (not yet optimized) schedule, returning the count of corrected tasks
+    int apply(const ScheduleHandle &schedule) const {
+        int count = 0;
+        LOOP(task, schedule->head) {
+            if (not time.count(task->name) and not workspace.count(task->name)) {
+                continue;
+            }
+            auto time_factor = timeFactor(task->name);
+            auto workspace_factor = workspaceFactor(task->name);
+            uint64_t duration = task->duration;
+            size_t workspace = task->workspace;
+            task->duration = static_cast<uint64_t>(duration * time_factor.original);
+            task->variance *= time_factor.original * time_factor.original;
+            task->recompute_duration = static_cast<uint64_t>(duration * time_factor.recomputed);
+            task->workspace = static_cast<size_t>(workspace * workspace_factor.original);
+            task->recompute_workspace = static_cast<size_t>(workspace * workspace_factor.recomputed);
+            ++ count;
+        }
+        schedule->analyzed = false;
+        return count;
+    }
+};
@@ -0,0 +1,340 @@
+#pragma once
+
+#include <atomic>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "schedule.hpp"
+#include "split.hpp"
+#include "timer.hpp"
+#include "utils.hpp"
+
+// State of a best-first search: the frontier, the dedup hashes, the best and counters
+struct SearchState {
+    ScheduleHandle best;
+    std::vector<ScheduleHandle> frontier;
+    std::vector<size_t> hashes;
+    int count = 0;
+    uint64_t used_time = 0;
+};
+
+// Periodic snapshots of a search written by a background thread, and the latest one read back for resuming.
+// Schedules are encoded as deltas of the origin: runs of consecutive origin tasks, and single words for others
+// (`position << 3 | log2(split) << 1 | recomputed`), so in-place rewrites (renaming operands) are not supported.
+// The file is binary: a header, the best, the frontier and the hashes, every list prefixed with its length
+class Checkpointer {
+    static constexpr char MAGIC[8] = {'D', 'L', 'M', 'O', 'C', 'K', 'P', '2'};
+    static constexpr uint32_t RUN = 1u << 31;
+    static constexpr int MAX_POSITION = 1 << 28;
+
+    std::string path;
+    uint64_t interval;
+
+    // Origin of the search, tasks by position
+    ScheduleHandle origin;
+    std::vector<TaskHandle> origin_tasks;
+    std::unordered_map<int, int> position;
+    size_t origin_digest = 0;
+    size_t limit = 0;
+
+    Timer timer;
+    uint64_t since_last = 0;
+    std::thread writer;
+    std::atomic<bool> writing;
+    int written = 0;
+
+    std::vector<uint32_t> encode(const ScheduleHandle &schedule) const {
+        std::vector<uint32_t> words;
+        int run_begin = -1, run_length = 0;
+        auto flush = [&]() {
+            if (run_length == 1) {
+                words.push_back(static_cast<uint32_t>(run_begin) << 3u);
+            } else if (run_length > 1) {
+                words.push_back(RUN | static_cast<uint32_t>(run_begin));
+                words.push_back(run_length);
+            }
+            run_length = 0;
+        };
+        LOOP(task, schedule->head) {
+            int p = position.at(task->id);
+            if (task->recomputed or task->split > 1) {
+                flush();
+                int log_split = 0;
+                while ((1 << log_split) < task->split) {
+                    ++ log_split;
+                }
+                words.push_back(static_cast<uint32_t>(p) << 3u | log_split << 1u | task->recomputed);
+            } else if (run_length > 0 and p == run_begin + run_length) {
+                ++ run_length;
+            } else {
+                flush();
+                run_begin = p, run_length = 1;
+            }
+        }
+        flush();
+        return words;
+    }
+
+    // Everything the positions and the analyses depend on: the graph with sizes, times and workspaces, the percentile,
+    // the split and data-parallel models, and the policy of the search
+    static size_t digest(const ScheduleHandle &origin, const std::string &policy) {
+        size_t value = 0;
+        auto mix = [&value](size_t item) {
+            value ^= item + 0x9e3779b97f4a7c15ull + (value << 6u) + (value >> 2u);
+        };
+        auto mixText = [&mix](const std::string &text) {
+            mix(std::hash<std::string>()(text));
+        };
+        auto mixReal = [&mix](double real) {
+            mix(std::hash<double>()(real));
+        };
+        auto &common = *origin->common;
+        mixText(policy);
+        mixReal(common.time_z);
+        for (auto &operand: common.operands) {
+            mix(operand ? operand->size : 0);
+        }
+        for (auto &operand: common.already_on) {
+            mix(operand->id);
+        }
+        for (auto &operand: common.not_dealloc) {
+            mix(operand->id);
+        }
+        LOOP(task, origin->head) {
+            mixText(task->name);
+            mix(task->id);
+            mix(task->duration), mix(task->recompute_duration), mixReal(task->variance);
+            mix(task->workspace), mix(task->recompute_workspace);
+            mix(task->inplace), mix(task->fused.size());
+            for (auto &usage: task->ins) {
+                mix(usage.operand->id);
+            }
+            mix(task->ins.size());
+            for (auto &usage: task->outs) {
+                mix(usage.operand->id);
+            }
+            mix(task->outs.size());
+        }
+        if (common.split) {
+            auto &model = *common.split;
+            for (auto &item: model.costs) {
+                mixText(item.first), mix(item.second.launch), mixReal(item.second.slowdown);
+            }
+            mix(model.base);
+            for (bool batched: model.batched) {
+                mix(batched);
+            }
+        }
+        mix(common.split != nullptr);
+        if (common.parallel) {
+            auto &model = *common.parallel;
+            mix(model.workers), mixReal(model.bandwidth), mix(model.latency), mix(model.buffer);
+            for (auto &bucket: model.buckets) {
+                for (int id: bucket) {
+                    mix(id);
+                }
+                mix(bucket.size());
+            }
+        }
+        mix(common.parallel != nullptr);
+        return value;
+    }
+
+    ScheduleHandle decode(const uint32_t *words, size_t length) const {
+        auto schedule = std::make_shared<Schedule>();
+        schedule->common = origin->common;
+        TaskHandle tail;
+        auto append = [&](const TaskHandle &task) {
+            if (not tail) {
+                schedule->head = task;
+            } else {
+                tail->next = task;
+                task->prev = tail;
+            }
+            tail = task;
+        };
+        for (size_t i = 0; i < length; ++ i) {
+            uint32_t word = words[i];
+            if (word & RUN) {
+                uint32_t begin = word & ~RUN, count = words[++ i];
+                for (uint32_t p = begin; p < begin + count; ++ p) {
+                    append(origin_tasks.at(p)->copy());
+                }
+                continue;
+            }
+            auto task = origin_tasks.at(word >> 3u)->copy();
+            int count = 1 << ((word >> 1u) & 3u);
+            if (count > 1) {
+                if (not origin->common->split) {
+                    error("Checkpoint %s has split tasks, but splitting is off\n", path.c_str());
+                }
+                SplitRewrite::split(task, count, *origin->common->split);
+            }
+            append((word & 1u) ? task->recompute() : task);
+        }
+        return schedule;
+    }
+
+    void write(const SearchState &state) {
+        auto temporary = path + ".tmp";
+        FILE *file = fopen(temporary.c_str(), "wb");
+        if (not file) {
+            warning("Failed to write checkpoint %s\n", temporary.c_str());
+            return;
+        }
+        auto put = [file](const void *data, size_t size) {
+            fwrite(data, 1, size, file);
+        };
+        auto putWords = [&](const std::vector<uint32_t> &words) {
+            uint64_t length = words.size();
+            put(&length, sizeof(length));
+            put(words.data(), sizeof(uint32_t) * length);
+        };
+        uint64_t origin_length = origin_tasks.size(), frontier_size = state.frontier.size(), hash_count = state.hashes.size();
+        put(MAGIC, sizeof(MAGIC));
+        put(&origin_digest, sizeof(origin_digest));
+        put(&origin_length, sizeof(origin_length));
+        put(&limit, sizeof(limit));
+        put(&state.count, sizeof(state.count));
+        put(&state.used_time, sizeof(state.used_time));
+        putWords(encode(state.best));
+        put(&frontier_size, sizeof(frontier_size));
+        for (auto &schedule: state.frontier) {
+            putWords(encode(schedule));
+        }
+        put(&hash_count, sizeof(hash_count));
+        put(state.hashes.data(), sizeof(size_t) * hash_count);
+        bool failed = ferror(file);
+        failed = fclose(file) != 0 or failed;
+
+        // Replaced at once, a checkpoint is either the previous or the new one
+        if (failed or std::rename(temporary.c_str(), path.c_str()) != 0) {
+            warning("Failed to write checkpoint %s\n", path.c_str());
+        }
+    }
+
+public:
+    static constexpr uint64_t DEFAULT_INTERVAL = Unit::s(60);
+
+    explicit Checkpointer(const std::string &path, uint64_t interval=DEFAULT_INTERVAL): path(path), interval(interval), writing(false) {}
+
+    ~Checkpointer() {
+        finish();
+    }
+
+    std::string name() const {
+        return path;
+    }
+
+    // Every search has its own origin, positions of its tasks are the encoding
+    void attach(const ScheduleHandle &origin, size_t limit, const std::string &policy) {
+        finish();
+        this->origin = origin;
+        this->limit = limit;
+        origin_tasks.clear();
+        position.clear();
+        LOOP(task, origin->head) {
+            if (task->recomputed or task->split > 1 or position.count(task->id)) {
+                error("Origin of a checkpointed search should only have distinct tasks\n");
+            }
+            position[task->id] = origin_tasks.size();
+            origin_tasks.push_back(task);
+        }
+        if (origin_tasks.size() >= MAX_POSITION) {
+            error("Too many tasks (%zu) to checkpoint\n", origin_tasks.size());
+        }
+        origin_digest = digest(origin, policy);
+        since_last = 0;
+        timer.tik();
+    }
+
+    // Returns false without a checkpoint of the same origin, options, policy and limit, schedules are not analyzed yet
+    bool load(SearchState &state) const {
+        std::ifstream file(path, std::ios::binary);
+        if (not file) {
+            return false;
+        }
+        std::vector<char> content((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+        size_t offset = 0;
+        auto get = [&](void *data, size_t size) {
+            if (offset + size > content.size()) {
+                error("Checkpoint %s is truncated\n", path.c_str());
+            }
+            std::memcpy(data, content.data() + offset, size);
+            offset += size;
+        };
+        auto getSchedule = [&]() {
+            uint64_t length;
+            get(&length, sizeof(length));
+            if (offset + sizeof(uint32_t) * length > content.size()) {
+                error("Checkpoint %s is truncated\n", path.c_str());
+            }
+            auto schedule = decode(reinterpret_cast<const uint32_t*>(content.data() + offset), length);
+            offset += sizeof(uint32_t) * length;
+            return schedule;
+        };
+        char magic[sizeof(MAGIC)];
+        size_t saved_digest, saved_limit;
+        uint64_t origin_length, frontier_size, hash_count;
+        get(magic, sizeof(magic));
+        if (std::memcmp(magic, MAGIC, sizeof(MAGIC)) != 0) {
+            error("%s is not a checkpoint\n", path.c_str());
+        }
+        get(&saved_digest, sizeof(saved_digest));
+        get(&origin_length, sizeof(origin_length));
+        get(&saved_limit, sizeof(saved_limit));
+        if (saved_digest != origin_digest or origin_length != origin_tasks.size() or saved_limit != limit) {
+            warning("Checkpoint %s is of another pattern, options, policy or limit, ignored\n", path.c_str());
+            return false;
+        }
+        get(&state.count, sizeof(state.count));
+        get(&state.used_time, sizeof(state.used_time));
+        state.best = getSchedule();
+        get(&frontier_size, sizeof(frontier_size));
+        state.frontier.clear();
+        for (uint64_t i = 0; i < frontier_size; ++ i) {
+            state.frontier.push_back(getSchedule());
+        }
+        get(&hash_count, sizeof(hash_count));
+        state.hashes.resize(hash_count);
+        get(state.hashes.data(), sizeof(size_t) * hash_count);
+        return true;
+    }
+
+    // Whether the interval has passed since the last write, and none is being written
+    bool due() {
+        since_last += timer.tik();
+        return since_last >= interval and not writing;
+    }
+
+    // Writes in the background, frontier schedules are not modified after they are analyzed, so they are encoded
+    // concurrently with the search
+    void save(SearchState &&state) {
+        finish();
+        since_last = 0;
+        writing = true;
+        ++ written;
+        writer = std::thread([this](const SearchState &state) {
+            write(state);
+            writing = false;
+        }, std::move(state));
+    }
+
+    int count() const {
+        return written;
+    }
+
+    void finish() {
+        if (writer.joinable()) {
+            writer.join();
+        }
+    }
+};
+
+constexpr char Checkpointer::MAGIC[8];
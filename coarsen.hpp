@@ -0,0 +1,182 @@
+#pragma once
+
+#include <algorithm>
+#include <map>
+#include <set>
+#include <vector>
+
+#include "schedule.hpp"
+#include "utils.hpp"
+
+// Merges dataflow-connected neighbours into super-tasks, which are expanded back by `Common::expand`
+class Coarsener {
+    // Blocks whose execution memory is this close to the peak are refined
+    static constexpr double PEAK_RATIO = 0.9;
+
+    int block_size;
+
+    TaskHandle merge(const Common &common, const std::vector<TaskHandle> &block,
+                     const std::map<OperandHandle, std::pair<int, int>> &appearance, int begin, int end) const {
+        if (block.size() == 1) {
+            return block[0]->copy();
+        }
+
+        // Operands only appearing inside the block are hidden
+        auto hidden = [&](const OperandHandle &operand) {
+            auto &range = appearance.at(operand);
+            return begin <= range.first and range.second < end and
+                   not common.already_on.count(operand) and not common.not_dealloc.count(operand);
+        };
+
+        auto task = std::make_shared<Task>();
+        task->id = block[0]->id;
+        task->name = ".block(" + std::to_string(block.size()) + ")";
+        std::set<OperandHandle> ins, outs, generated;
+        std::map<OperandHandle, int> last_position;
+        for (int i = 0; i < block.size(); ++ i) {
+            for (auto &usage: block[i]->ins) {
+                last_position[usage.operand] = i;
+            }
+            for (auto &usage: block[i]->outs) {
+                last_position[usage.operand] = i;
+            }
+        }
+
+        // Internal transient memory of hidden operands becomes workspace
+        size_t live = 0;
+        for (int i = 0; i < block.size(); ++ i) {
+            auto &inner = block[i];
+            for (auto &usage: inner->ins) {
+                if (not generated.count(usage.operand) and not ins.count(usage.operand)) {
+                    ins.insert(usage.operand);
+                    task->ins.push_back(OperandUsage {usage.operand});
+                }
+            }
+            for (auto &usage: inner->outs) {
+                if (hidden(usage.operand)) {
+                    if (not generated.count(usage.operand)) {
+                        live += usage.operand->size;
+                    }
+                } else if (not outs.count(usage.operand)) {
+                    outs.insert(usage.operand);
+                    task->outs.push_back(OperandUsage {usage.operand});
+                }
+                generated.insert(usage.operand);
+            }
+            task->workspace = std::max(task->workspace, live + inner->workspace);
+            task->recompute_workspace = std::max(task->recompute_workspace, live + inner->recompute_workspace);
+            task->duration += inner->duration;
+            task->recompute_duration += inner->recompute_duration;
+            task->variance += inner->variance;
+            task->fused.push_back(inner->copy());
+            for (auto &item: last_position) {
+                if (item.second == i and hidden(item.first)) {
+                    live -= item.first->size;
+                }
+            }
+        }
+        for (auto &usage: task->outs) {
+            task->inplace = task->inplace or ins.count(usage.operand);
+        }
+        return task;
+    }
+
+public:
+    explicit Coarsener(int block_size): block_size(block_size) {}
+
+    ScheduleHandle coarsen(const ScheduleHandle &schedule) const {
+        auto &common = *schedule->common;
+
+        // First and last positions where operands appear
+        std::vector<TaskHandle> tasks;
+        std::map<OperandHandle, std::pair<int, int>> appearance;
+        LOOP(task, schedule->head) {
+            int position = tasks.size();
+            for (auto *usages: {&task->ins, &task->outs}) {
+                for (auto &usage: *usages) {
+                    if (not appearance.count(usage.operand)) {
+                        appearance[usage.operand] = std::make_pair(position, position);
+                    }
+                    appearance[usage.operand].second = position;
+                }
+            }
+            tasks.push_back(task);
+        }
+
+        // Greedily grow blocks while the next task consumes an operand generated inside
+        auto new_schedule = std::make_shared<Schedule>();
+        new_schedule->common = schedule->common;
+        TaskHandle tail;
+        auto insert_back = [&new_schedule, &tail](const TaskHandle &task) {
+            if (not tail) {
+                new_schedule->head = task;
+            } else {
+                tail->next = task;
+                task->prev = tail;
+            }
+            tail = task;
+        };
+        std::vector<TaskHandle> block;
+        std::set<OperandHandle> generated;
+        int begin = 0;
+        for (int i = 0; i < tasks.size(); ++ i) {
+            auto &task = tasks[i];
+            bool connected = false;
+            for (auto &usage: task->ins) {
+                connected = connected or generated.count(usage.operand);
+            }
+            if (not block.empty() and (not connected or block.size() == block_size)) {
+                insert_back(merge(common, block, appearance, begin, i));
+                block.clear();
+                generated.clear();
+                begin = i;
+            }
+            block.push_back(task);
+            for (auto &usage: task->outs) {
+                generated.insert(usage.operand);
+            }
+        }
+        if (not block.empty()) {
+            insert_back(merge(common, block, appearance, begin, tasks.size()));
+        }
+        tail->next = nullptr;
+        return new_schedule;
+    }
+
+    // Blocks above the limit or close to the peak are expanded for the fine search, the others stay coarse
+    static ScheduleHandle refine(const ScheduleHandle &schedule) {
+        schedule->analyze();
+        size_t limit = schedule->common->limit;
+        auto new_schedule = std::make_shared<Schedule>();
+        new_schedule->common = schedule->common;
+        TaskHandle tail;
+        auto insert_back = [&new_schedule, &tail](const TaskHandle &task) {
+            if (not tail) {
+                new_schedule->head = task;
+            } else {
+                tail->next = task;
+                task->prev = tail;
+            }
+            tail = task;
+        };
+        LOOP(task, schedule->head) {
+            bool near = (limit > 0 and task->execution_memory > limit) or task->execution_memory >= PEAK_RATIO * schedule->peak_memory;
+            if (task->isBlock() and near) {
+                for (auto &inner: task->fused) {
+                    insert_back(inner->copy());
+                }
+            } else {
+                insert_back(task->copy());
+            }
+        }
+        return new_schedule;
+    }
+
+    static int count(const ScheduleHandle &schedule) {
+        int count = 0;
+        LOOP(task, schedule->head) {
+            ++ count;
+        }
+        return count;
+    }
+};
@@ -0,0 +1,246 @@
+#pragma once
+
+#include <algorithm>
+#include <fstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "json.hpp"
+#include "optimizer.hpp"
+#include "schedule.hpp"
+#include "timer.hpp"
+#include "utils.hpp"
+
+// Memory over one iteration of an analyzed schedule, a step starting at every task
+struct Timeline {
+    uint64_t period = 0;
+    std::vector<uint64_t> starts;
+    std::vector<size_t> memory;
+
+    static Timeline fromSchedule(const ScheduleHandle &schedule) {
+        schedule->analyze();
+        Timeline timeline;
+        LOOP(task, schedule->head) {
+            timeline.starts.push_back(timeline.period);
+            timeline.memory.push_back(task->execution_memory);
+            timeline.period += task->duration;
+        }
+        timeline.period = std::max<uint64_t>(timeline.period, 1);
+        return timeline;
+    }
+
+    // Memory at `time` after the start of an iteration, iterations repeat
+    size_t at(uint64_t time) const {
+        time %= period;
+        auto it = std::upper_bound(starts.begin(), starts.end(), time);
+        return it == starts.begin() ? memory.front() : memory[it - starts.begin() - 1];
+    }
+};
+
+// A model sharing the device, starting its iterations at `phase` (chosen while optimizing if `free`)
+struct Tenant {
+    int id = 0;
+    std::string pattern;
+    bool free = false;
+    uint64_t phase = 0;
+
+    // Filled after loading
+    ScheduleHandle origin;
+    int count = 0;
+    size_t budget = 0;
+    Optimizer::Result result;
+    Timeline timeline;
+
+    ScheduleHandle best() const {
+        return result.best ? result.best : origin;
+    }
+
+    size_t at(uint64_t time) const {
+        return timeline.at(time + timeline.period - phase % timeline.period);
+    }
+};
+
+// Models co-located on one device under a shared limit: shorter iterations repeat within the longest one, phases and
+// re-computations are chosen jointly so that the combined timeline fits
+class Colocation {
+    static constexpr int MAX_ROUNDS = 8;
+    static constexpr int PHASE_CANDIDATES = 64;
+    static constexpr int PHASE_SWEEPS = 2;
+
+    std::string config_path;
+    size_t limit = 0;
+    std::vector<Tenant> tenants;
+
+    uint64_t window() const {
+        uint64_t longest = 0;
+        for (auto &tenant: tenants) {
+            longest = std::max(longest, tenant.timeline.period);
+        }
+        return longest;
+    }
+
+    // Combined memory is only checked where some step starts, returns the peak and its time
+    std::pair<size_t, uint64_t> combinedPeak() const {
+        uint64_t length = window();
+        std::vector<uint64_t> events;
+        for (auto &tenant: tenants) {
+            auto &timeline = tenant.timeline;
+            for (auto start: timeline.starts) {
+                for (uint64_t time = (start + tenant.phase) % timeline.period; time < length; time += timeline.period) {
+                    events.push_back(time);
+                }
+            }
+        }
+        std::sort(events.begin(), events.end());
+        events.erase(std::unique(events.begin(), events.end()), events.end());
+        std::pair<size_t, uint64_t> peak(0, 0);
+        for (auto time: events) {
+            size_t memory = 0;
+            for (auto &tenant: tenants) {
+                memory += tenant.at(time);
+            }
+            if (memory > peak.first) {
+                peak = std::make_pair(memory, time);
+            }
+        }
+        return peak;
+    }
+
+    // Coordinate descent over evenly spaced phases of free models, the others stay fixed
+    void rephase() {
+        for (int sweep = 0; sweep < PHASE_SWEEPS; ++ sweep) {
+            for (auto &tenant: tenants) {
+                if (not tenant.free) {
+                    continue;
+                }
+                uint64_t best_phase = tenant.phase;
+                size_t best_peak = combinedPeak().first;
+                for (int i = 0; i < PHASE_CANDIDATES; ++ i) {
+                    tenant.phase = tenant.timeline.period * i / PHASE_CANDIDATES;
+                    size_t peak = combinedPeak().first;
+                    if (peak < best_peak) {
+                        best_peak = peak, best_phase = tenant.phase;
+                    }
+                }
+                tenant.phase = best_phase;
+            }
+        }
+    }
+
+public:
+    explicit Colocation(const std::string &config_path): config_path(config_path) {}
+
+    void load() {
+        std::ifstream config_file(config_path);
+        if (not config_file) {
+            error("Failed to open co-location config %s\n", config_path.c_str());
+        }
+        nlohmann::json config;
+        config_file >> config;
+        limit = Unit::fromText(config["limit"]);
+
+        // Models have their own operands, they are only related by the shared limit
+        for (auto &model: config["models"]) {
+            Tenant tenant;
+            tenant.id = tenants.size();
+            tenant.pattern = model["pattern"];
+            if (model.count("phase") and model["phase"].is_string()) {
+                if (model["phase"] != "free") {
+                    error("Phase of model %d should be a number (ns) or \"free\"\n", tenant.id);
+                }
+                tenant.free = true;
+            } else {
+                tenant.phase = model.value("phase", static_cast<uint64_t>(0));
+            }
+            std::tie(tenant.origin, tenant.count) = Schedule::fromFile(tenant.pattern);
+            tenant.timeline = Timeline::fromSchedule(tenant.origin);
+            tenant.budget = tenant.origin->peak_memory;
+            tenants.push_back(tenant);
+        }
+        if (tenants.empty()) {
+            error("No model in co-location config %s\n", config_path.c_str());
+        }
+    }
+
+    void optimize(const std::string &output_prefix) {
+        printf("Running co-location %s (%zu models, limit %s) ... \n", config_path.c_str(), tenants.size(), prettyBytes(limit).c_str());
+        size_t individual = 0;
+        for (auto &tenant: tenants) {
+            printf(" > Model %d: %s (%d operators), %s, phase %s\n", tenant.id, tenant.pattern.c_str(), tenant.count,
+                   tenant.origin->info().c_str(), tenant.free ? "free" : prettyNanoseconds(tenant.phase).c_str());
+            individual += tenant.origin->peak_memory;
+        }
+
+        // Every round re-phases, then cuts the excess at the combined peak from the model keeping the largest part of
+        // its own peak (a budget caps the whole timeline, not only the collision), or from all models in proportion to
+        // their memory there if none can take it alone. Budgets only shrink and are searched concurrently from origins
+        Timer timer;
+        rephase();
+        auto peak = combinedPeak();
+        printf(" > Combined peak %s (sum of individual peaks %s) at %s\n", prettyBytes(peak.first).c_str(),
+               prettyBytes(individual).c_str(), prettyNanoseconds(peak.second).c_str());
+        for (int round = 0; round < MAX_ROUNDS and peak.first > limit; ++ round) {
+            size_t excess = peak.first - limit;
+            std::vector<Tenant*> tightened;
+            Tenant *chosen = nullptr;
+            double kept = 0;
+            for (auto &tenant: tenants) {
+                size_t memory = tenant.at(peak.second);
+                double ratio = static_cast<double>(memory - excess) / tenant.best()->peak_memory;
+                if (memory > excess and memory - excess < tenant.budget and ratio > kept) {
+                    chosen = &tenant, kept = ratio;
+                }
+            }
+            if (chosen) {
+                chosen->budget = chosen->at(peak.second) - excess;
+                tightened.push_back(chosen);
+            } else {
+                for (auto &tenant: tenants) {
+                    size_t memory = tenant.at(peak.second);
+                    size_t cut = static_cast<size_t>(static_cast<double>(excess) * memory / peak.first) + 1;
+                    if (memory > cut and memory - cut < tenant.budget) {
+                        tenant.budget = memory - cut;
+                        tightened.push_back(&tenant);
+                    }
+                }
+            }
+            std::vector<std::thread> threads;
+            for (auto tenant: tightened) {
+                threads.emplace_back([tenant]() {
+                    tenant->result = Optimizer(tenant->budget).search(tenant->origin, false);
+                    tenant->timeline = Timeline::fromSchedule(tenant->result.best);
+                });
+            }
+            for (auto &thread: threads) {
+                thread.join();
+            }
+            rephase();
+            auto new_peak = combinedPeak();
+            printf(" > Round %d: %zu models tightened, combined peak %s at %s\n", round, tightened.size(),
+                   prettyBytes(new_peak.first).c_str(), prettyNanoseconds(new_peak.second).c_str());
+            peak = new_peak;
+            if (tightened.empty()) {
+                break;
+            }
+        }
+
+        // Report
+        printf(" > Result (time used: %s):\n", prettyNanoseconds(timer.tik()).c_str());
+        for (auto &tenant: tenants) {
+            auto best = tenant.best();
+            printf("   > Model %d: budget %s, phase %s, best {%s}, searched %d\n", tenant.id, prettyBytes(tenant.budget).c_str(),
+                   prettyNanoseconds(tenant.phase).c_str(), best->info().c_str(), tenant.result.count);
+        }
+        printf("   > Combined peak: %s\n", prettyBytes(peak.first).c_str());
+        printf("   > Satisfy memory: %s\n", peak.first <= limit ? "true" : "false");
+
+        // Write results
+        for (auto &tenant: tenants) {
+            auto path = output_prefix + ".model" + std::to_string(tenant.id) + ".json";
+            printf(" > Writing model %d into path %s ... ", tenant.id, path.c_str());
+            tenant.best()->restoreAndDumpToFile(path);
+            printf("OK!\n");
+        }
+    }
+};
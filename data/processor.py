@@ -1,6 +1,7 @@
 import json
 import os
 import functools
+import sys
 
 
 def same(array):
@@ -11,21 +12,27 @@ def same(array):
     return True
 
 
-def merge(function_path, timeline_path, memory_path, pattern_path):
-    # Read traced functions
-    with open(function_path, 'r') as file:
-        schedule = json.load(file)
-        codes = schedule['code']
-        data = schedule['data']
-        first_code, last_code = None, None
-        for code in codes:
-            if code['name'].startswith('.'):
-                continue
-            if not first_code:
-                first_code = code['name']
-            last_code = code['name']
+def average(l):
+    return sum(l[2:]) / (len(l) - 2)
+
+
+def variance(l):
+    mean = average(l)
+    return sum((x - mean) ** 2 for x in l[2:]) / (len(l) - 2)
 
-    # Read timeline
+
+def code_range(codes):
+    first_code, last_code = None, None
+    for code in codes:
+        if code['name'].startswith('.'):
+            continue
+        if not first_code:
+            first_code = code['name']
+        last_code = code['name']
+    return first_code, last_code
+
+
+def read_timeline(timeline_path, first_code, last_code):
     with open(timeline_path, 'r') as file:
         n = int(file.readline())
         cuda_streams = []
@@ -59,14 +66,30 @@ def merge(function_path, timeline_path, memory_path, pattern_path):
             except ValueError:
                 # print('Error at line: {}'.format(line), end='')
                 pass
+    return times
 
-    # Read memory
+
+def read_memory(memory_path):
     workspaces = {}
     with open(memory_path, 'r') as file:
         records = json.load(file)['records']
         for record in records:
             name = record['name']
             workspaces[name] = (workspaces[name] if workspaces.get(name) else []) + [record['workspaceUsage']]
+    return workspaces
+
+
+def merge(function_path, timeline_path, memory_path, pattern_path):
+    # Read traced functions
+    with open(function_path, 'r') as file:
+        schedule = json.load(file)
+        codes = schedule['code']
+        data = schedule['data']
+        first_code, last_code = code_range(codes)
+
+    # Read timeline and memory
+    times = read_timeline(timeline_path, first_code, last_code)
+    workspaces = read_memory(memory_path)
 
     # Count operators
     op_counts = {}
@@ -96,7 +119,6 @@ def merge(function_path, timeline_path, memory_path, pattern_path):
         operands.append(operand)
 
     # Generate code
-    average = lambda l: sum(l[2:]) / (len(l) - 2)
     indexing = {}
     records = []
     last_name = ''
@@ -113,6 +135,7 @@ def merge(function_path, timeline_path, memory_path, pattern_path):
         else:
             code['workspace'] = workspaces[name][index + op_counts[name]]
             code['time'] = average(times[name][index::op_counts[name]]) if not name.startswith('.') else 0
+            code['time_var'] = variance(times[name][index::op_counts[name]]) if not name.startswith('.') else 0
             records.append(code)
         last_name = name
 
@@ -123,7 +146,66 @@ def merge(function_path, timeline_path, memory_path, pattern_path):
         json.dump(content, file, indent=4)
 
 
-if __name__ == '__main__':
+def calibrate(pattern_path, optimized_path, timeline_path, memory_path, calibration_path):
+    # Predictions (per operator name) in the merged IR
+    with open(pattern_path, 'r') as file:
+        predicted_times, predicted_workspaces = {}, {}
+        for code in json.load(file)['code']:
+            name = code['name']
+            if not name.startswith('.'):
+                predicted_times[name] = predicted_times.get(name, []) + [code['time']]
+                predicted_workspaces[name] = predicted_workspaces.get(name, []) + [code['workspace']]
+
+    # Optimized IR, an operator re-generating operands (not inplace) is a re-computation
+    with open(optimized_path, 'r') as file:
+        codes = json.load(file)['code']
+    first_code, last_code = code_range(codes)
+    kinds, op_counts, generated = [], {}, set()
+    for code in codes:
+        name = code['name']
+        if name.startswith('.'):
+            continue
+        recomputed = any(out in generated and out not in code['ins'] for out in code['outs'])
+        generated.update(code['outs'])
+        kinds.append((name, op_counts.get(name, 0), 'recomputed' if recomputed else 'original'))
+        op_counts[name] = op_counts.get(name, 0) + 1
+
+    # Measured, fit as ratios of sums
+    times = read_timeline(timeline_path, first_code, last_code)
+    workspaces = read_memory(memory_path)
+    sums = {}
+    for name, index, kind in kinds:
+        if name not in predicted_times or name not in times or name not in workspaces:
+            continue
+        measured = sums.setdefault(name, {}).setdefault(kind, [0, 0, 0, 0])
+        measured[0] += average(times[name][index::op_counts[name]])
+        measured[1] += sum(predicted_times[name]) / len(predicted_times[name])
+        measured[2] += workspaces[name][index + op_counts[name]]
+        measured[3] += sum(predicted_workspaces[name]) / len(predicted_workspaces[name])
+    calibration = {'time': {}, 'workspace': {}}
+    for name, kind_sums in sums.items():
+        for kind, (time, predicted_time, workspace, predicted_workspace) in kind_sums.items():
+            if predicted_time > 0:
+                calibration['time'].setdefault(name, {})[kind] = time / predicted_time
+            if predicted_workspace > 0:
+                calibration['workspace'].setdefault(name, {})[kind] = workspace / predicted_workspace
+
+    # Write into file
+    with open(calibration_path, 'w') as file:
+        json.dump(calibration, file, indent=4)
+
+
+if __name__ == '__main__' and sys.argv[1:] == ['calibrate']:
+    # Put the optimized IR `optimized.json` and its profiling results `optimized_timeline.txt` and
+    # `optimized_memory.json` beside `pattern.json`
+    for d in os.listdir():
+        paths = [os.path.join(d, name) for name in
+                 ['pattern.json', 'optimized.json', 'optimized_timeline.txt', 'optimized_memory.json']]
+        if os.path.isdir(d) and all(map(os.path.exists, paths)):
+            print('Calibrating model {} ... '.format(d), end='')
+            calibrate(*paths, os.path.join(d, 'calibration.json'))
+            print('done!')
+elif __name__ == '__main__':
     for d in os.listdir():
         function_path = os.path.join(d, 'function.json')
         timeline_path = os.path.join(d, 'timeline.txt')
@@ -0,0 +1,221 @@
+#include <algorithm>
+#include <cstddef>
+#include <cstring>
+#include <exception>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "dlmo.h"
+#include "optimizer.hpp"
+#include "runner.hpp"
+#include "schedule.hpp"
+#include "utils.hpp"
+
+struct dlmo_graph {
+    struct Record {
+        std::string name;
+        std::vector<int32_t> ins, outs;
+        uint64_t duration;
+        size_t workspace;
+    };
+
+    std::vector<size_t> sizes;
+    std::vector<Record> records;
+};
+
+struct dlmo_plan {
+    std::vector<int> kinds;
+    std::vector<int32_t> tasks;
+    std::vector<std::vector<int32_t>> ins, outs;
+    uint64_t peak_memory = 0, total_time = 0;
+    bool satisfied = false;
+};
+
+static thread_local std::string last_error;
+
+static int fail(const std::string &message) {
+    last_error = message;
+    return -1;
+}
+
+// Same as `Schedule::fromJson`, task ids are indices plus one
+static ScheduleHandle build(const dlmo_graph &graph) {
+    auto schedule = std::make_shared<Schedule>();
+    auto &common = schedule->common = std::make_shared<Common>();
+    for (int i = 0; i < graph.sizes.size(); ++ i) {
+        common->operands.push_back(std::make_shared<Operand>(graph.sizes[i], i, nlohmann::json::object()));
+    }
+    TaskHandle tail;
+    for (int i = 0; i < graph.records.size(); ++ i) {
+        auto &record = graph.records[i];
+        auto task = std::make_shared<Task>();
+        task->id = i + 1;
+        task->name = record.name;
+        for (int32_t id: record.ins) {
+            task->ins.push_back(OperandUsage {common->operands[id]});
+        }
+        for (int32_t id: record.outs) {
+            task->outs.push_back(OperandUsage {common->operands[id]});
+        }
+        task->duration = task->recompute_duration = record.duration;
+        task->workspace = task->recompute_workspace = record.workspace;
+        task->detectInplace();
+        if (not tail) {
+            schedule->head = task;
+        } else {
+            tail->next = task;
+            task->prev = tail;
+        }
+        tail = task;
+    }
+    schedule->prepare("graph");
+    return schedule;
+}
+
+extern "C" {
+
+const char *dlmo_last_error(void) {
+    return last_error.c_str();
+}
+
+dlmo_graph *dlmo_graph_create(const uint64_t *operand_sizes, size_t operand_count) {
+    auto graph = new dlmo_graph();
+    graph->sizes.assign(operand_sizes, operand_sizes + operand_count);
+    return graph;
+}
+
+int32_t dlmo_graph_add_task(dlmo_graph *graph, const char *name,
+                            const int32_t *ins, size_t in_count, const int32_t *outs, size_t out_count,
+                            uint64_t duration_ns, uint64_t workspace) {
+    dlmo_graph::Record record {name, std::vector<int32_t>(ins, ins + in_count), std::vector<int32_t>(outs, outs + out_count),
+                               duration_ns, workspace};
+    for (auto *ids: {&record.ins, &record.outs}) {
+        for (int32_t id: *ids) {
+            if (id < 0 or id >= graph->sizes.size()) {
+                return fail("Operand " + std::to_string(id) + " of task " + record.name + " is out of range");
+            }
+        }
+    }
+    Task task;
+    task.name = record.name;
+    if (task.isForbidden()) {
+        return fail("Task " + record.name + " is not supported");
+    }
+    if (task.isDealloc() and not record.ins.empty()) {
+        return fail("Task .dealloc takes no inputs, operands to free are its outputs");
+    }
+    if (task.isShare() and (record.ins.size() != 1 or record.outs.size() != 1)) {
+        return fail("Task .share takes the source as its only input and the view as its only output");
+    }
+    graph->records.push_back(record);
+    return graph->records.size() - 1;
+}
+
+void dlmo_graph_destroy(dlmo_graph *graph) {
+    delete graph;
+}
+
+void dlmo_options_init(dlmo_options *options) {
+    options->size = sizeof(dlmo_options);
+    options->limit = 0;
+    options->percentile = 50;
+    options->inplace = 0;
+    options->coarsen = 1;
+    options->calibration = nullptr;
+    options->progress = nullptr;
+    options->user_data = nullptr;
+}
+
+int dlmo_optimize(const dlmo_graph *graph, const dlmo_options *caller_options, dlmo_plan **plan) {
+    try {
+        // Fields the caller does not know keep their defaults, the first layout ends with `user_data`
+        if (caller_options->size < offsetof(dlmo_options, user_data) + sizeof(caller_options->user_data)) {
+            return fail("Options should be set up by dlmo_options_init");
+        }
+        dlmo_options defaults;
+        dlmo_options_init(&defaults);
+        std::memcpy(&defaults, caller_options, std::min<size_t>(caller_options->size, sizeof(dlmo_options)));
+        defaults.size = sizeof(dlmo_options);
+        auto options = &defaults;
+        if (graph->records.empty()) {
+            return fail("Graph is empty");
+        }
+        if (options->percentile < 50 or options->percentile >= 100) {
+            return fail("Percentile should be in [50, 100)");
+        }
+        Options run_options;
+        run_options.percentile = options->percentile;
+        run_options.inplace = options->inplace;
+        run_options.coarsen = std::max(options->coarsen, 1);
+        run_options.calibration = options->calibration ? options->calibration : "";
+        run_options.verbose = false;
+        if (options->progress) {
+            auto progress = options->progress;
+            auto user_data = options->user_data;
+            run_options.progress = [progress, user_data](int count, const ScheduleHandle &best) {
+                return progress(count, best->peak_memory, best->total_time, user_data) != 0;
+            };
+        }
+        auto result = Runner::optimize(build(*graph), options->limit, run_options);
+
+        // Restore to the IR format and read back
+        auto &best = result.best;
+        best->common->restore(best->head);
+        best->common->check(best->head);
+        std::unique_ptr<dlmo_plan> new_plan(new dlmo_plan());
+        LOOP(task, best->head) {
+            bool special = task->isDealloc() or task->isShare();
+            int kind = task->recomputed ? DLMO_ENTRY_RECOMPUTE : DLMO_ENTRY_TASK;
+            if (special) {
+                kind = task->isDealloc() ? DLMO_ENTRY_DEALLOC : DLMO_ENTRY_SHARE;
+            }
+            new_plan->kinds.push_back(kind);
+            new_plan->tasks.push_back(special ? -1 : task->id - 1);
+            new_plan->ins.emplace_back();
+            new_plan->outs.emplace_back();
+            for (auto &usage: task->ins) {
+                new_plan->ins.back().push_back(usage.operand->id);
+            }
+            for (auto &usage: task->outs) {
+                new_plan->outs.back().push_back(usage.operand->id);
+            }
+        }
+        new_plan->peak_memory = best->peak_memory;
+        new_plan->total_time = best->total_time;
+        new_plan->satisfied = result.satisfied;
+        *plan = new_plan.release();
+        return 0;
+    } catch (const std::exception &exception) {
+        return fail(exception.what());
+    }
+}
+
+size_t dlmo_plan_size(const dlmo_plan *plan) {
+    return plan->kinds.size();
+}
+
+int dlmo_plan_entry(const dlmo_plan *plan, size_t index, dlmo_entry *entry) {
+    if (index >= plan->kinds.size()) {
+        return fail("Plan entry " + std::to_string(index) + " is out of range");
+    }
+    entry->kind = plan->kinds[index];
+    entry->task = plan->tasks[index];
+    entry->ins = plan->ins[index].data();
+    entry->in_count = plan->ins[index].size();
+    entry->outs = plan->outs[index].data();
+    entry->out_count = plan->outs[index].size();
+    return 0;
+}
+
+void dlmo_plan_stats(const dlmo_plan *plan, uint64_t *peak_memory, uint64_t *total_time, int *satisfied) {
+    *peak_memory = plan->peak_memory;
+    *total_time = plan->total_time;
+    *satisfied = plan->satisfied;
+}
+
+void dlmo_plan_destroy(dlmo_plan *plan) {
+    delete plan;
+}
+
+}
@@ -0,0 +1,73 @@
+#ifndef DLMO_H
+#define DLMO_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// A graph in the IR format: operands, then tasks in execution order (including `.dealloc` and `.share`)
+typedef struct dlmo_graph dlmo_graph;
+
+// An optimized plan, read back entry by entry
+typedef struct dlmo_plan dlmo_plan;
+
+// Returning zero stops the search, the best found so far is kept
+typedef int (*dlmo_progress_callback)(int searched, uint64_t peak_memory, uint64_t total_time, void *user_data);
+
+// Set up by `dlmo_options_init`, `size` is the size of the structure the caller was compiled with, so fields added
+// later keep their defaults for older callers
+typedef struct {
+    uint32_t size;
+    uint64_t limit;
+    double percentile;
+    int inplace;
+    int coarsen;
+    const char *calibration;
+    dlmo_progress_callback progress;
+    void *user_data;
+} dlmo_options;
+
+enum {
+    DLMO_ENTRY_TASK = 0,
+    DLMO_ENTRY_RECOMPUTE = 1,
+    DLMO_ENTRY_SHARE = 2,
+    DLMO_ENTRY_DEALLOC = 3
+};
+
+typedef struct {
+    int kind;
+    // Index returned by `dlmo_graph_add_task`, -1 for `.share` and `.dealloc`
+    int32_t task;
+    const int32_t *ins;
+    size_t in_count;
+    const int32_t *outs;
+    size_t out_count;
+} dlmo_entry;
+
+// Functions returning int give 0 on success and -1 on failure, with the reason in `dlmo_last_error`
+const char *dlmo_last_error(void);
+
+dlmo_graph *dlmo_graph_create(const uint64_t *operand_sizes, size_t operand_count);
+// Operands follow the IR: `.dealloc` takes no inputs and frees its outputs, `.share` takes the source as its only
+// input and the view as its only output, other shapes of them are rejected
+int32_t dlmo_graph_add_task(dlmo_graph *graph, const char *name,
+                            const int32_t *ins, size_t in_count, const int32_t *outs, size_t out_count,
+                            uint64_t duration_ns, uint64_t workspace);
+void dlmo_graph_destroy(dlmo_graph *graph);
+
+void dlmo_options_init(dlmo_options *options);
+int dlmo_optimize(const dlmo_graph *graph, const dlmo_options *options, dlmo_plan **plan);
+
+size_t dlmo_plan_size(const dlmo_plan *plan);
+int dlmo_plan_entry(const dlmo_plan *plan, size_t index, dlmo_entry *entry);
+void dlmo_plan_stats(const dlmo_plan *plan, uint64_t *peak_memory, uint64_t *total_time, int *satisfied);
+void dlmo_plan_destroy(dlmo_plan *plan);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
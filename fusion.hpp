@@ -0,0 +1,174 @@
+#pragma once
+
+#include <algorithm>
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+
+#include "schedule.hpp"
+#include "utils.hpp"
+
+// Chain of adjacent element-wise tasks, whose intermediates are only used by the next task in the chain
+struct FusionSuggestion {
+    std::vector<TaskHandle> chain;
+    std::vector<OperandHandle> intermediates;
+    size_t memory_saved = 0;
+    uint64_t time_saved = 0;
+
+    std::string name() const {
+        std::string name;
+        for (auto &task: chain) {
+            name += (name.empty() ? "" : "+") + task->name;
+        }
+        return name;
+    }
+};
+
+class Fusion {
+    static size_t touchedBytes(const TaskHandle &task) {
+        size_t bytes = 0;
+        for (auto &usage: task->ins) {
+            bytes += usage.operand->size;
+        }
+        for (auto &usage: task->outs) {
+            bytes += usage.operand->size;
+        }
+        return bytes;
+    }
+
+    // Time of a memory-bound task spent on one operand, nothing for tasks touching no bytes
+    static uint64_t timeOf(const TaskHandle &task, const OperandHandle &operand) {
+        size_t bytes = touchedBytes(task);
+        return bytes ? static_cast<uint64_t>(static_cast<double>(task->duration) * operand->size / bytes) : 0;
+    }
+
+    static bool intermediate(const Common &common, const TaskHandle &task, OperandHandle &operand) {
+        // The only output of `task` which is only used by the next task
+        auto &next = task->next;
+        if (not next or task->outs.size() != 1 or task->inplace or next->inplace) {
+            return false;
+        }
+        auto &usage = task->outs[0];
+        if (common.not_dealloc.count(usage.operand) or usage.next_use != next or not next->contains(usage.operand, false)) {
+            return false;
+        }
+        if (next->find(usage.operand, false).next_use or next->contains(usage.operand)) {
+            return false;
+        }
+        operand = usage.operand;
+        return true;
+    }
+
+public:
+    // Run after analyzing the schedule, suggestions are ranked by memory saved at the peak (then time)
+    static std::vector<FusionSuggestion> analyze(const ScheduleHandle &schedule) {
+        schedule->analyze();
+        auto &common = *schedule->common;
+
+        int peak_time_stamp = schedule->profile.peak.time_stamp;
+
+        std::vector<FusionSuggestion> suggestions;
+        for (auto task = schedule->head; task; ) {
+            OperandHandle operand;
+            if (not task->isElementwise() or not task->next or not task->next->isElementwise() or not intermediate(common, task, operand)) {
+                task = task->next;
+                continue;
+            }
+
+            // Extend the chain as long as possible
+            FusionSuggestion suggestion;
+            suggestion.chain.push_back(task);
+            while (task->next and task->next->isElementwise() and intermediate(common, task, operand)) {
+                // Memory-bound kernels: the fused one skips writing and reading the intermediate
+                auto &next = task->next;
+                suggestion.intermediates.push_back(operand);
+                suggestion.time_saved += timeOf(task, operand) + timeOf(next, operand);
+                // Intermediate lives in [task, next]
+                if (task->time_stamp <= peak_time_stamp and peak_time_stamp <= next->time_stamp) {
+                    suggestion.memory_saved += operand->size;
+                }
+                suggestion.chain.push_back(next);
+                task = next;
+            }
+            if (suggestion.memory_saved > 0) {
+                suggestions.push_back(suggestion);
+            }
+            task = task->next;
+        }
+
+        std::sort(suggestions.begin(), suggestions.end(), [](const FusionSuggestion &s1, const FusionSuggestion &s2) {
+            if (s1.memory_saved != s2.memory_saved) {
+                return s1.memory_saved > s2.memory_saved;
+            }
+            return s1.time_saved > s2.time_saved;
+        });
+        return suggestions;
+    }
+
+    // Replace every suggested chain with one simulated task, origin tasks are expanded back in `Common::restore`
+    static ScheduleHandle apply(const ScheduleHandle &schedule, const std::vector<FusionSuggestion> &suggestions) {
+        std::map<TaskHandle, const FusionSuggestion*> first;
+        std::set<TaskHandle> fused;
+        for (auto &suggestion: suggestions) {
+            first[suggestion.chain.front()] = &suggestion;
+            fused.insert(suggestion.chain.begin(), suggestion.chain.end());
+        }
+
+        auto new_schedule = std::make_shared<Schedule>();
+        new_schedule->common = schedule->common;
+        TaskHandle tail;
+        LOOP(task, schedule->head) {
+            TaskHandle new_task;
+            if (first.count(task)) {
+                auto &suggestion = *first[task];
+                std::set<OperandHandle> intermediates(suggestion.intermediates.begin(), suggestion.intermediates.end());
+                std::set<OperandHandle> ins;
+                new_task = std::make_shared<Task>();
+                new_task->id = task->id;
+                new_task->name = ".fused(" + suggestion.name() + ")";
+                for (auto &origin: suggestion.chain) {
+                    for (auto &usage: origin->ins) {
+                        if (not intermediates.count(usage.operand) and not ins.count(usage.operand)) {
+                            ins.insert(usage.operand);
+                            new_task->ins.push_back(OperandUsage {usage.operand});
+                        }
+                    }
+                    new_task->workspace = std::max(new_task->workspace, origin->workspace);
+                    new_task->recompute_workspace = std::max(new_task->recompute_workspace, origin->recompute_workspace);
+                    new_task->duration += origin->duration;
+                    new_task->recompute_duration += origin->recompute_duration;
+                    new_task->variance += origin->variance;
+                    new_task->fused.push_back(origin->copy());
+                }
+                for (auto &usage: suggestion.chain.back()->outs) {
+                    new_task->outs.push_back(OperandUsage {usage.operand});
+                }
+                new_task->duration -= std::min(new_task->duration, suggestion.time_saved);
+                new_task->recompute_duration -= std::min(new_task->recompute_duration, suggestion.time_saved);
+            } else if (not fused.count(task)) {
+                new_task = task->copy();
+            } else {
+                continue;
+            }
+            if (not tail) {
+                new_schedule->head = new_task;
+            } else {
+                tail->next = new_task;
+                new_task->prev = tail;
+            }
+            tail = new_task;
+        }
+        tail->next = nullptr;
+        return new_schedule;
+    }
+
+    static void report(const std::vector<FusionSuggestion> &suggestions) {
+        printf(" > Fusion suggestions (%zu chains contributing to the peak):\n", suggestions.size());
+        for (auto &suggestion: suggestions) {
+            printf("   > %s (task %d): %s less at the peak, %s faster\n", suggestion.name().c_str(),
+                   suggestion.chain.front()->id, prettyBytes(suggestion.memory_saved).c_str(),
+                   prettyNanoseconds(suggestion.time_saved).c_str());
+        }
+    }
+};
@@ -0,0 +1,122 @@
+#pragma once
+
+#include <map>
+#include <set>
+#include <vector>
+
+#include "schedule.hpp"
+#include "utils.hpp"
+
+// An element-wise task which can write its output into an input without later uses
+struct InplaceCandidate {
+    TaskHandle task;
+    OperandHandle in, out;
+    size_t memory_saved = 0;
+};
+
+class InplaceRewrite {
+    // Only tasks whose execution memory is this close to the peak are considered
+    static constexpr double PEAK_RATIO = 0.9;
+
+public:
+    // Run after analyzing the schedule
+    static std::vector<InplaceCandidate> analyze(const ScheduleHandle &schedule) {
+        schedule->analyze();
+        auto &common = *schedule->common;
+        auto excluded = [&common](const OperandHandle &operand) {
+            return common.already_on.count(operand) or common.not_dealloc.count(operand);
+        };
+
+        // Last generation of every operand, an input generated again later (re-computed) would collide with the output
+        std::map<OperandHandle, int> last_gen;
+        LOOP(task, schedule->head) {
+            for (auto &usage: task->outs) {
+                last_gen[usage.operand] = task->time_stamp;
+            }
+        }
+
+        // Operands appearing before (and in) each task, outputs must be firstly generated by the rewritten task
+        std::set<OperandHandle> appeared;
+        std::vector<InplaceCandidate> candidates;
+        LOOP(task, schedule->head) {
+            bool considered = task->isElementwise() and not task->inplace and task->fused.empty() and
+                              task->execution_memory >= PEAK_RATIO * schedule->peak_memory;
+            for (int i = 0; considered and i < task->outs.size(); ++ i) {
+                auto &out = task->outs[i].operand;
+                if (excluded(out) or appeared.count(out)) {
+                    continue;
+                }
+                bool found = false;
+                for (auto &usage: task->ins) {
+                    bool regenerated = last_gen.count(usage.operand) and last_gen[usage.operand] > task->time_stamp;
+                    if (not usage.next_use and not regenerated and usage.operand->size == out->size and not excluded(usage.operand)) {
+                        candidates.push_back(InplaceCandidate {task, usage.operand, out, out->size});
+                        found = true;
+                        break;
+                    }
+                }
+                if (found) {
+                    break;
+                }
+            }
+            for (auto &usage: task->ins) {
+                appeared.insert(usage.operand);
+            }
+            for (auto &usage: task->outs) {
+                appeared.insert(usage.operand);
+            }
+        }
+        return candidates;
+    }
+
+    // Rename `out` into `in` from the rewritten task, origin names are kept on the renamed tasks of the new schedule
+    // for `.share` in `Common::restore`
+    static ScheduleHandle apply(const ScheduleHandle &schedule, const InplaceCandidate &candidate) {
+        auto new_schedule = schedule->copy();
+        auto &real_task = new_schedule->common->real_task;
+        // Time stamps are the positions in the analyzed schedule
+        int position = 0;
+        LOOP(task, new_schedule->head) {
+            bool rewritten = ++ position == candidate.task->time_stamp;
+            if (position < candidate.task->time_stamp or not (task->contains(candidate.out) or task->contains(candidate.out, false))) {
+                continue;
+            }
+            // Fused tasks keep origin names inside, they could not be renamed
+            if (not task->fused.empty()) {
+                return nullptr;
+            }
+            if (not task->origin_names) {
+                // Names before `.share` renaming if any, they are the origin ones
+                auto it = real_task.find(task->id);
+                auto &source = it != real_task.end() ? it->second : task;
+                auto backup = std::make_shared<Task>();
+                for (auto &usage: source->ins) {
+                    backup->ins.push_back(OperandUsage {usage.operand});
+                }
+                for (auto &usage: source->outs) {
+                    backup->outs.push_back(OperandUsage {usage.operand});
+                }
+                task->origin_names = backup;
+            }
+            for (auto &usage: task->ins) {
+                if (usage.operand == candidate.out) {
+                    usage.operand = candidate.in;
+                }
+            }
+            for (auto &usage: task->outs) {
+                if (usage.operand == candidate.out) {
+                    usage.operand = candidate.in;
+                }
+            }
+            task->inplace = task->inplace or rewritten;
+        }
+        return safe(new_schedule) ? new_schedule : nullptr;
+    }
+
+    static bool safe(const ScheduleHandle &schedule) {
+        // Restore a copy into the IR format and check it
+        auto restored = schedule->copy();
+        restored->common->restore(restored->head);
+        return restored->common->check(restored->head, false, false);
+    }
+};
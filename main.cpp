@@ -1,18 +1,91 @@
+#include <cstring>
 #include <iostream>
 #include <memory>
+#include <thread>
 
+#include "analysis.hpp"
+#include "batch.hpp"
+#include "colocate.hpp"
+#include "pipeline.hpp"
+#include "replay.hpp"
 #include "runner.hpp"
 #include "utils.hpp"
+#include "validator.hpp"
 
 int main(int argc, char **argv) {
-    if (argc != 4) {
-        std::cerr << "Usage: dlmo <input> <output> <limit>" << std::endl;
+    // Pipeline-parallel mode
+    if (argc == 4 and std::strcmp(argv[1], "pipeline") == 0) {
+        auto pipeline = Pipeline(argv[2]);
+        pipeline.load();
+        pipeline.optimize(argv[3]);
+        return 0;
+    }
+
+    // Models co-located on one device
+    if (argc == 4 and std::strcmp(argv[1], "colocate") == 0) {
+        auto colocation = Colocation(argv[2]);
+        colocation.load();
+        colocation.optimize(argv[3]);
+        return 0;
+    }
+
+    // Peak memory and time of a pattern without searching
+    if (argc >= 3 and std::strcmp(argv[1], "analyze") == 0) {
+        return Analysis::fromArguments(std::vector<std::string>(argv + 3, argv + argc)).run(argv[2]) ? 0 : 1;
+    }
+
+    // Dataflow validation of an optimized output
+    if ((argc == 4 or argc == 5) and std::strcmp(argv[1], "validate") == 0) {
+        int threads = std::thread::hardware_concurrency();
+        if (argc == 5) {
+            std::string argument = argv[4];
+            auto pos = argument.find('=');
+            if (argument.substr(0, pos) != "--threads" or pos == std::string::npos) {
+                error("Unknown option %s\n", argument.c_str());
+            }
+            threads = std::stoi(argument.substr(pos + 1));
+            if (threads <= 0) {
+                error("Thread count should be positive\n");
+            }
+        }
+        auto validation = Validator(threads).validateFiles(argv[2], argv[3]);
+        Validator::report(validation);
+        return validation.passed() ? 0 : 1;
+    }
+
+    // Host replay of an optimized output
+    if (argc >= 4 and std::strcmp(argv[1], "replay") == 0) {
+        Replayer::fromArguments(std::vector<std::string>(argv + 4, argv + argc)).run(argv[2], argv[3]);
+        return 0;
+    }
+
+    // Maximum batch size within the limit and a slowdown
+    if (argc >= 5 and std::strcmp(argv[1], "batch") == 0) {
+        auto limit = Unit::fromText(argv[4]);
+        BatchSearch::fromArguments(limit, std::vector<std::string>(argv + 5, argv + argc)).run(argv[2], argv[3]);
+        return 0;
+    }
+
+    if (argc < 4) {
+        std::cerr << "Usage: dlmo <input> <output> <limit> [--percentile=<p>] [--calibration=<path>]" << std::endl;
+        std::cerr << "            [--fusion=none|report|simulate] [--inplace] [--partition=<k>] [--coarsen=<k>] [--stream=<window>]" << std::endl;
+        std::cerr << "            [--processes=<n>] [--split[=<model>]] [--data-parallel=<config>]" << std::endl;
+        std::cerr << "            [--replicate] [--validate] [--checkpoint=<path>] [--checkpoint-interval=<seconds>] [--resume]" << std::endl;
+        std::cerr << "            [--strategy=best-first|beam|greedy] [--objective=balanced|memory] [--cost=balanced|memory]" << std::endl;
+        std::cerr << "       dlmo batch <input> <output> <limit> [--slowdown=<ratio>] [--base-batch=<n>] [<options>]" << std::endl;
+        std::cerr << "       dlmo analyze <input> [--limit=<limit>] [--top=<n>] [--percentile=<p>] [--calibration=<path>]" << std::endl;
+        std::cerr << "            [--data-parallel=<config>] [--threads=<n>] [--check-threads]" << std::endl;
+        std::cerr << "       dlmo pipeline <config> <output-prefix>" << std::endl;
+        std::cerr << "       dlmo colocate <config> <output-prefix>" << std::endl;
+        std::cerr << "       dlmo validate <input> <output> [--threads=<n>]" << std::endl;
+        std::cerr << "       dlmo replay <input> <output> [--allocator=malloc|arena|caching] [--touch]" << std::endl;
         exit(0);
     }
 
     // Run cases
     std::string input(argv[1]), output(argv[2]), limit(argv[3]);
-    auto runner = Runner(input, output, Unit::fromText(limit));
+    auto options = Options::fromArguments(std::vector<std::string>(argv + 4, argv + argc));
+    auto runner = Runner(input, output, Unit::fromText(limit), options);
     runner.run();
 
     return 0;
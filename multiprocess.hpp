@@ -0,0 +1,435 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <fcntl.h>
+#include <fstream>
+#include <map>
+#include <new>
+#include <pthread.h>
+#include <queue>
+#include <sstream>
+#include <sched.h>
+#include <string>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+#include "optimizer.hpp"
+#include "schedule.hpp"
+#include "timer.hpp"
+#include "utils.hpp"
+
+// Search with forked workers sharing a lock-free frontier and a dedup table in a shared memory region.
+// Schedules are exchanged in a compact encoding: one word per task (`id << 1 | recomputed`),
+// so in-place rewrites (renaming operands) are not supported in this mode.
+class ProcessSearch {
+    static constexpr size_t RING_SIZE = 1ull << 16;
+    static constexpr size_t TABLE_SIZE = 1ull << 20;
+    static constexpr size_t MAX_ARENA_WORDS = 1ull << 26;
+    // Capacity of encodings relative to the source length
+    static constexpr int BEST_LENGTH_RATIO = 4;
+    static constexpr int ARENA_LENGTH_RATIO = 4096;
+    static constexpr int PROBE_LIMIT = 64;
+    static constexpr size_t LOCAL_QUEUE_LIMIT = 16;
+    static constexpr int WAIT_INTERVAL_MS = 10;
+
+    struct Slot {
+        std::atomic<uint64_t> sequence;
+        uint64_t offset;
+        uint32_t length;
+    };
+
+    struct Best {
+        uint32_t length;
+        size_t peak_memory;
+        uint64_t total_time;
+    };
+
+    struct Header {
+        std::atomic<uint64_t> arena_used, head, tail;
+        std::atomic<int> searched, idle, stop;
+        // Double-buffered best schedule (in its own area), guarded by a robust mutex, a worker dying while
+        // writing one buffer leaves the published one intact
+        pthread_mutex_t lock;
+        Best best[2];
+        int best_index;
+    };
+
+    size_t limit;
+    int workers, search_limit;
+
+    // Shared region
+    std::string name;
+    size_t region_size = 0;
+    void *region = nullptr;
+    Header *header = nullptr;
+    Slot *ring = nullptr;
+    std::atomic<uint64_t> *table = nullptr;
+    uint32_t *best_area = nullptr, *arena = nullptr;
+    size_t best_capacity = 0, arena_words = 0;
+
+    // Origin tasks (inherited by workers through `fork`)
+    std::map<int, TaskHandle> origin_tasks;
+    ScheduleHandle origin;
+
+    void map(size_t length) {
+        name = "/dlmo-" + std::to_string(getpid());
+        best_capacity = length * BEST_LENGTH_RATIO;
+        arena_words = std::min(MAX_ARENA_WORDS, length * ARENA_LENGTH_RATIO);
+        region_size = sizeof(Header) + sizeof(Slot) * RING_SIZE + sizeof(std::atomic<uint64_t>) * TABLE_SIZE;
+        region_size += sizeof(uint32_t) * (2 * best_capacity + arena_words);
+        int fd = shm_open(name.c_str(), O_CREAT | O_RDWR | O_EXCL, 0600);
+        if (fd < 0 or ftruncate(fd, region_size) != 0) {
+            error("Failed to create shared memory region %s\n", name.c_str());
+        }
+        region = mmap(nullptr, region_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        close(fd);
+        if (region == MAP_FAILED) {
+            error("Failed to map shared memory region %s\n", name.c_str());
+        }
+
+        // Layout: header, frontier ring, dedup table, two best encodings, arena of encodings
+        auto ptr = static_cast<char*>(region);
+        header = new (ptr) Header();
+        ptr += sizeof(Header);
+        ring = reinterpret_cast<Slot*>(ptr);
+        for (size_t i = 0; i < RING_SIZE; ++ i) {
+            new (&ring[i].sequence) std::atomic<uint64_t>(i);
+        }
+        ptr += sizeof(Slot) * RING_SIZE;
+        table = reinterpret_cast<std::atomic<uint64_t>*>(ptr);
+        ptr += sizeof(std::atomic<uint64_t>) * TABLE_SIZE;
+        best_area = reinterpret_cast<uint32_t*>(ptr);
+        arena = best_area + 2 * best_capacity;
+        header->arena_used = header->head = header->tail = 0;
+        header->searched = header->idle = header->stop = 0;
+        header->best_index = 0;
+        pthread_mutexattr_t attr;
+        pthread_mutexattr_init(&attr);
+        pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+        pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+        if (pthread_mutex_init(&header->lock, &attr) != 0) {
+            error("Failed to initialize the lock of shared memory region %s\n", name.c_str());
+        }
+        pthread_mutexattr_destroy(&attr);
+    }
+
+    void unmap() {
+        pthread_mutex_destroy(&header->lock);
+        munmap(region, region_size);
+        shm_unlink(name.c_str());
+    }
+
+    // Dedup table, returns whether `hash` is newly inserted
+    bool insert(size_t hash) {
+        uint64_t value = hash | 1ull;
+        for (int i = 0; i < PROBE_LIMIT; ++ i) {
+            auto &entry = table[(value + i) % TABLE_SIZE];
+            uint64_t expected = 0;
+            if (entry.compare_exchange_strong(expected, value)) {
+                return true;
+            }
+            if (expected == value) {
+                return false;
+            }
+        }
+        // Full around, treat as new
+        return true;
+    }
+
+    static uint32_t count(const ScheduleHandle &schedule) {
+        uint32_t length = 0;
+        LOOP(task, schedule->head) {
+            ++ length;
+        }
+        return length;
+    }
+
+    static void encode(const ScheduleHandle &schedule, uint32_t *ptr) {
+        LOOP(task, schedule->head) {
+            *(ptr ++) = static_cast<uint32_t>(task->id) << 1u | static_cast<uint32_t>(task->recomputed);
+        }
+    }
+
+    bool encode(const ScheduleHandle &schedule, uint64_t &offset, uint32_t &length) {
+        length = count(schedule);
+        offset = header->arena_used.fetch_add(length);
+        if (offset + length > arena_words) {
+            return false;
+        }
+        encode(schedule, arena + offset);
+        return true;
+    }
+
+    ScheduleHandle decode(const uint32_t *ptr, uint32_t length) {
+        auto schedule = std::make_shared<Schedule>();
+        schedule->common = origin->common;
+        TaskHandle tail;
+        for (uint32_t i = 0; i < length; ++ i) {
+            uint32_t word = ptr[i];
+            auto &task = origin_tasks[static_cast<int>(word >> 1u)];
+            auto new_task = (word & 1u) ? task->recompute() : task->copy();
+            if (not tail) {
+                schedule->head = new_task;
+            } else {
+                tail->next = new_task;
+                new_task->prev = tail;
+            }
+            tail = new_task;
+        }
+        return schedule;
+    }
+
+    // Bounded MPMC queue (Vyukov)
+    bool push(const ScheduleHandle &schedule) {
+        uint64_t offset;
+        uint32_t length;
+        if (not encode(schedule, offset, length)) {
+            return false;
+        }
+        uint64_t pos = header->tail.load();
+        Slot *slot;
+        while (true) {
+            slot = &ring[pos % RING_SIZE];
+            auto diff = static_cast<int64_t>(slot->sequence.load(std::memory_order_acquire) - pos);
+            if (diff == 0 and header->tail.compare_exchange_weak(pos, pos + 1)) {
+                break;
+            } else if (diff < 0) {
+                return false;
+            } else if (diff > 0) {
+                pos = header->tail.load();
+            }
+        }
+        slot->offset = offset, slot->length = length;
+        slot->sequence.store(pos + 1, std::memory_order_release);
+        return true;
+    }
+
+    ScheduleHandle pop() {
+        uint64_t pos = header->head.load();
+        Slot *slot;
+        while (true) {
+            slot = &ring[pos % RING_SIZE];
+            auto diff = static_cast<int64_t>(slot->sequence.load(std::memory_order_acquire) - (pos + 1));
+            if (diff == 0 and header->head.compare_exchange_weak(pos, pos + 1)) {
+                break;
+            } else if (diff < 0) {
+                return nullptr;
+            } else if (diff > 0) {
+                pos = header->head.load();
+            }
+        }
+        auto schedule = decode(arena + slot->offset, slot->length);
+        slot->sequence.store(pos + RING_SIZE, std::memory_order_release);
+        return schedule;
+    }
+
+    void lock() {
+        if (pthread_mutex_lock(&header->lock) == EOWNERDEAD) {
+            // The owner died, at most in the unpublished buffer
+            pthread_mutex_consistent(&header->lock);
+        }
+    }
+
+    void unlock() {
+        pthread_mutex_unlock(&header->lock);
+    }
+
+    std::pair<size_t, uint64_t> best() {
+        lock();
+        auto &best = header->best[header->best_index];
+        auto statistics = std::make_pair(best.peak_memory, best.total_time);
+        unlock();
+        return statistics;
+    }
+
+    void update(const Comparator &comparator, const ScheduleHandle &schedule) {
+        // Analyze outside the lock, only the comparison and the copy are inside
+        auto statistics = schedule->analyze();
+        uint32_t length = count(schedule);
+        if (length > best_capacity) {
+            return;
+        }
+        lock();
+        auto &best = header->best[header->best_index];
+        if (comparator(std::make_pair(best.peak_memory, best.total_time), statistics)) {
+            int next = 1 - header->best_index;
+            encode(schedule, best_area + next * best_capacity);
+            header->best[next] = Best {length, statistics.first, statistics.second};
+            header->best_index = next;
+        }
+        unlock();
+    }
+
+    static std::vector<std::vector<int>> numaNodes() {
+        // CPUs of every NUMA node, from sysfs
+        std::vector<std::vector<int>> nodes;
+        for (int node = 0; ; ++ node) {
+            std::ifstream file("/sys/devices/system/node/node" + std::to_string(node) + "/cpulist");
+            if (not file) {
+                break;
+            }
+            std::string list, range;
+            file >> list;
+            std::vector<int> cpus;
+            std::stringstream ss(list);
+            while (std::getline(ss, range, ',')) {
+                auto dash = range.find('-');
+                int first = std::stoi(range.substr(0, dash));
+                int last = dash == std::string::npos ? first : std::stoi(range.substr(dash + 1));
+                for (int cpu = first; cpu <= last; ++ cpu) {
+                    cpus.push_back(cpu);
+                }
+            }
+            nodes.push_back(cpus);
+        }
+        return nodes;
+    }
+
+    static void pin(int worker) {
+        auto nodes = numaNodes();
+        if (nodes.empty()) {
+            return;
+        }
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        for (int cpu: nodes[worker % nodes.size()]) {
+            CPU_SET(cpu, &set);
+        }
+        sched_setaffinity(0, sizeof(set), &set);
+    }
+
+    void work(int worker) {
+        pin(worker);
+        auto comparator = Comparator{origin->analyze().second, limit};
+        std::priority_queue<ScheduleHandle, std::vector<ScheduleHandle>, Comparator> queue(comparator);
+        bool idle = false;
+        while (not header->stop) {
+            // Take from the local queue first, then the shared frontier
+            ScheduleHandle top;
+            if (not queue.empty()) {
+                top = queue.top();
+                queue.pop();
+            } else if ((top = pop())) {
+                if (idle) {
+                    idle = false;
+                    -- header->idle;
+                }
+            } else {
+                if (not idle) {
+                    idle = true;
+                    ++ header->idle;
+                }
+                if (header->idle >= workers and header->head == header->tail) {
+                    break;
+                }
+                std::this_thread::yield();
+                continue;
+            }
+
+            if (not comparator.considerable(best(), top->analyze())) {
+                continue;
+            }
+            int count = ++ header->searched;
+
+            // Substitute, share surplus with idle workers
+            for (auto &substitution: Optimizer::generateSubstitutions(top, false)) {
+                if (not insert(substitution->hash())) {
+                    continue;
+                }
+                if (comparator(best(), substitution->analyze())) {
+                    update(comparator, substitution);
+                }
+                if (comparator.considerable(best(), substitution->analyze())) {
+                    bool share = header->idle > 0 or queue.size() > LOCAL_QUEUE_LIMIT;
+                    if (not share or not push(substitution)) {
+                        queue.push(substitution);
+                    }
+                }
+            }
+
+            if (comparator.satisfy(best()) or count >= search_limit) {
+                header->stop = 1;
+            }
+        }
+    }
+
+public:
+    ProcessSearch(size_t limit, int workers, int search_limit): limit(limit), workers(workers), search_limit(search_limit) {}
+
+    Optimizer::Result search(const ScheduleHandle &schedule) {
+        Timer timer;
+        origin = schedule;
+        origin->common->limit = limit;
+        origin->analyze();
+        LOOP(task, origin->head) {
+            origin_tasks[task->id] = task;
+        }
+        uint32_t length = count(origin);
+        if (origin_tasks.size() != length) {
+            error("Task ids should be unique in multi-process search\n");
+        }
+
+        // Initialize the region with the source
+        map(length);
+        header->best[0] = Best {length, origin->peak_memory, origin->total_time};
+        encode(origin, best_area);
+        insert(origin->hash());
+        push(origin);
+        printf(" > Start multi-process search with %d workers from source (%s)\n", workers, origin->info().c_str());
+
+        // Fork workers, a crashed worker does not affect others
+        std::vector<pid_t> pids;
+        for (int i = 0; i < workers; ++ i) {
+            pid_t pid = fork();
+            if (pid == 0) {
+                work(i);
+                _exit(0);
+            } else if (pid < 0) {
+                error("Failed to fork worker %d\n", i);
+            }
+            pids.push_back(pid);
+        }
+        // Only our workers are reaped, polled so a crashed one is noticed while others still run
+        std::vector<bool> exited(workers, false);
+        for (int remaining = workers; remaining > 0; ) {
+            bool reaped = false;
+            for (int i = 0; i < workers; ++ i) {
+                int status = 0;
+                if (exited[i] or waitpid(pids[i], &status, WNOHANG) != pids[i]) {
+                    continue;
+                }
+                exited[i] = reaped = true;
+                -- remaining;
+                if (not WIFEXITED(status) or WEXITSTATUS(status) != 0) {
+                    warning("Worker %d exited abnormally (status %d)\n", i, status);
+                    // Let the others finish
+                    ++ header->idle;
+                }
+            }
+            if (not reaped and remaining > 0) {
+                std::this_thread::sleep_for(std::chrono::milliseconds(WAIT_INTERVAL_MS));
+            }
+        }
+
+        Optimizer::Result result;
+        result.origin = origin;
+        auto &best = header->best[header->best_index];
+        result.best = decode(best_area + header->best_index * best_capacity, best.length);
+        result.best->analyze();
+        result.count = header->searched;
+        result.used_time = timer.tik();
+        result.satisfied = result.best->peak_memory <= limit;
+        unmap();
+        return result;
+    }
+};
+
+constexpr size_t ProcessSearch::MAX_ARENA_WORDS;
+constexpr int ProcessSearch::WAIT_INTERVAL_MS;
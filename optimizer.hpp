@@ -1,36 +1,60 @@
 #pragma once
 
+#include <functional>
+#include <iterator>
 #include <queue>
+#include <set>
 #include <sstream>
+#include <string>
 
+#include "checkpoint.hpp"
+#include "inplace.hpp"
 #include "schedule.hpp"
+#include "split.hpp"
 #include "timer.hpp"
 #include "utils.hpp"
 
-class Optimizer {
+// Settings, results and substitutions shared by all instantiations of the search
+class SearchBase {
+public:
     static constexpr int SEARCH_LIMIT = 1500;
     static constexpr int PRINT_FREQUENCY = 300;
 
+    // Called with the searched count and the best after every expansion, returning false stops the search
+    typedef std::function<bool(int, const ScheduleHandle&)> Progress;
+
+    // Builds the substitution of a re-computation (`Schedule::apply` if unset), returning null skips it
+    typedef std::function<ScheduleHandle(const ScheduleHandle&, const Occupy&)> Applier;
+
+protected:
     size_t limit;
+    bool inplace;
+    int search_limit;
+    Progress progress;
+    Applier applier;
+    std::shared_ptr<Checkpointer> checkpointer;
 
 public:
-    explicit Optimizer(size_t limit) {
+    explicit SearchBase(size_t limit, bool inplace=false, int search_limit=SEARCH_LIMIT, const Progress &progress=nullptr,
+                        const Applier &applier=nullptr, const std::shared_ptr<Checkpointer> &checkpointer=nullptr) {
         this->limit = limit;
+        this->inplace = inplace;
+        this->search_limit = search_limit;
+        this->progress = progress;
+        this->applier = applier;
+        this->checkpointer = checkpointer;
     }
 
-    std::string name() const {
-        return "optimizer (limit " + prettyBytes(limit) + ")";
-    }
-
-    static std::vector<ScheduleHandle> generateSubstitutions(const ScheduleHandle &schedule) {
+    template <typename Cost=BalancedCost>
+    static std::vector<ScheduleHandle> generateSubstitutions(const ScheduleHandle &schedule, bool inplace, const Applier &applier=nullptr) {
         // Analyze schedule
-        schedule->analyze();
+        auto occupies = schedule->analyzeOccupies<Cost>();
 
         // Re-generate graph
-        // printf(" @ Generating substitutions (count: %zu, peak: %s, time: %s) ...\n", schedule->occupies.size(),
+        // printf(" @ Generating substitutions (count: %zu, peak: %s, time: %s) ...\n", occupies.size(),
         //        prettyBytes(schedule->peak_memory).c_str(), prettyNanoseconds(schedule->total_time).c_str());
         std::vector<ScheduleHandle> substitutions;
-        for (auto &occupy: schedule->occupies) {
+        for (auto &occupy: occupies) {
             // printf("   @ [%s, %s] occupies (score1=%.6lf, score2=%.6lf)\n", occupy.gen->name.c_str(),
             //        occupy.use->name.c_str(), occupy.score1, occupy.score2);
             // printf("   @ Moving: %d\n", occupy.move);
@@ -43,29 +67,165 @@ public:
             // for (auto &task: occupy.re_gen) {
             //     printf("     @ Re-gen: %s\n", task->name.c_str());
             // }
-            auto new_schedule = schedule->apply(occupy);
+            auto new_schedule = applier ? applier(schedule, occupy) : schedule->apply(occupy);
+            if (not new_schedule) {
+                continue;
+            }
             substitutions.push_back(new_schedule);
             new_schedule->analyze();
             // printf("   @ Optimized to (peak: %s, memory: %s, s1: %.3lf, s2: %.3lf)\n", prettyBytes(new_schedule->peak_memory).c_str(),
             //        prettyNanoseconds(new_schedule->total_time).c_str(), occupy.score1, occupy.score2);
         }
+
+        // In-place rewrites around the peak
+        if (inplace) {
+            for (auto &candidate: InplaceRewrite::analyze(schedule)) {
+                auto new_schedule = InplaceRewrite::apply(schedule, candidate);
+                if (new_schedule) {
+                    substitutions.push_back(new_schedule);
+                    new_schedule->analyze();
+                }
+            }
+        }
+
+        // Splitting tasks around the peak over the batch dimension
+        if (schedule->common->split) {
+            for (auto &candidate: SplitRewrite::analyze(schedule)) {
+                auto new_schedule = SplitRewrite::apply(schedule, candidate);
+                substitutions.push_back(new_schedule);
+                new_schedule->analyze();
+            }
+        }
         return substitutions;
     };
 
-    void optimize(const ScheduleHandle &origin, const std::string &output_path) const {
+    struct Result {
+        ScheduleHandle origin, best;
+        int count = 0;
+        uint64_t used_time = 0;
+        bool satisfied = false;
+    };
+
+};
+
+// Expands the best of all generated schedules
+struct BestFirst {
+    static std::string name() {
+        return "best-first";
+    }
+
+    template <typename Compare>
+    class Frontier: public std::priority_queue<ScheduleHandle, std::vector<ScheduleHandle>, Compare> {
+    public:
+        explicit Frontier(const Compare &compare): std::priority_queue<ScheduleHandle, std::vector<ScheduleHandle>, Compare>(compare) {}
+
+        // Listed for checkpoints
+        std::vector<ScheduleHandle> schedules() const {
+            return this->c;
+        }
+    };
+};
+
+// Keeps only the `WIDTH` best schedules in the frontier, a greedy descent with a single one
+template <int WIDTH>
+struct Beam {
+    static std::string name() {
+        return "beam " + std::to_string(WIDTH);
+    }
+
+    template <typename Compare>
+    class Frontier {
+        // Ascending, the best is the last
+        std::multiset<ScheduleHandle, Compare> ranked;
+
+    public:
+        explicit Frontier(const Compare &compare): ranked(compare) {}
+
+        bool empty() const {
+            return ranked.empty();
+        }
+
+        size_t size() const {
+            return ranked.size();
+        }
+
+        const ScheduleHandle &top() const {
+            return *ranked.rbegin();
+        }
+
+        void pop() {
+            ranked.erase(std::prev(ranked.end()));
+        }
+
+        void push(const ScheduleHandle &schedule) {
+            ranked.insert(schedule);
+            if (ranked.size() > static_cast<size_t>(WIDTH)) {
+                ranked.erase(ranked.begin());
+            }
+        }
+
+        std::vector<ScheduleHandle> schedules() const {
+            return std::vector<ScheduleHandle>(ranked.begin(), ranked.end());
+        }
+    };
+};
+
+// The search over a strategy (the frontier), an objective (weights of the comparator) and a cost model (scores of
+// re-computations), all inlined into the loop
+template <typename Strategy, typename Objective, typename Cost>
+class BasicOptimizer: public SearchBase {
+public:
+    using SearchBase::SearchBase;
+
+    explicit BasicOptimizer(const SearchBase &settings): SearchBase(settings) {}
+
+    Result search(const ScheduleHandle &origin, bool verbose=true, uint64_t origin_time=0) const {
         ScheduleHandle best = origin;
-        auto comparator = Comparator{origin->analyze().second, limit};
+        origin->common->limit = limit;
+        auto comparator = ObjectiveComparator<Objective>{origin_time ? origin_time : origin->analyze().second, limit};
         std::set<size_t> hash_set;
-        std::priority_queue<ScheduleHandle, std::vector<ScheduleHandle>, Comparator> queue(comparator);
+        typename Strategy::template Frontier<ObjectiveComparator<Objective>> queue(comparator);
+        int count = 0;
+        uint64_t used_time = 0;
 
-        // Source
-        queue.push(origin);
-        hash_set.insert(origin->hash());
+        // Source, or the state of the last checkpoint
+        SearchState state;
+        if (checkpointer) {
+            checkpointer->attach(origin, limit, Strategy::name() + ", " + Objective::name() + " objective, " + Cost::name() + " cost");
+        }
+        if (checkpointer and checkpointer->load(state)) {
+            best = state.best;
+            best->analyze();
+            for (auto &schedule: state.frontier) {
+                schedule->analyze();
+                queue.push(schedule);
+            }
+            hash_set.insert(state.hashes.begin(), state.hashes.end());
+            count = state.count;
+            used_time = state.used_time;
+            if (verbose) {
+                printf(" > Resume back-tracing search from checkpoint %s (%d searched, %zu in frontier, best: %s)\n",
+                       checkpointer->name().c_str(), count, queue.size(), best->info().c_str());
+            }
+        } else {
+            queue.push(origin);
+            hash_set.insert(origin->hash());
+            if (verbose) {
+                printf(" > Start back-tracing search from source (%s)\n", origin->info().c_str());
+            }
+        }
+        auto snapshot = [&]() {
+            SearchState snapshot;
+            snapshot.best = best;
+            snapshot.frontier = queue.schedules();
+            snapshot.hashes.assign(hash_set.begin(), hash_set.end());
+            snapshot.count = count;
+            snapshot.used_time = used_time;
+            return snapshot;
+        };
 
         // Back-tracing search
-        printf(" > Start back-tracing search from source (%s)\n", origin->info().c_str());
         Timer timer;
-        int count = 0;
         while (not queue.empty()) {
             auto top = queue.top();
             queue.pop();
@@ -77,7 +237,7 @@ public:
             ++ count;
 
             // Substitute
-            std::vector<ScheduleHandle> substitutions = generateSubstitutions(top);
+            std::vector<ScheduleHandle> substitutions = generateSubstitutions<Cost>(top, inplace, applier);
 
             // Insert and check
             for (auto &substitution: substitutions) {
@@ -93,31 +253,161 @@ public:
                 }
             }
 
+            if (checkpointer and checkpointer->due()) {
+                used_time += timer.tik();
+                checkpointer->save(snapshot());
+            }
+
             if (comparator.satisfy(best)) {
-                printf(" > Already satisfy requirement, stop searching\n");
+                if (verbose) {
+                    printf(" > Already satisfy requirement, stop searching\n");
+                }
+                break;
+            }
+
+            if (progress and not progress(count, best)) {
+                if (verbose) {
+                    printf(" > Stopped by the progress callback\n");
+                }
                 break;
             }
 
-            if (count == SEARCH_LIMIT) {
-                printf(" > Reach search limit, stop searching\n");
+            if (count >= search_limit) {
+                if (verbose) {
+                    printf(" > Reach search limit, stop searching\n");
+                }
                 break;
             }
 
-            if (count % PRINT_FREQUENCY == 0) {
+            if (verbose and count % PRINT_FREQUENCY == 0) {
                 printf(" > Progress (%d): %s, %s\n", count, prettyBytes(top->peak_memory).c_str(), prettyNanoseconds(top->total_time).c_str());
             }
         }
+        used_time += timer.tik();
+
+        // The final state, so an interrupted or stopped search can be continued
+        if (checkpointer) {
+            checkpointer->save(snapshot());
+            checkpointer->finish();
+            if (verbose) {
+                printf(" > Written %d checkpoints into %s\n", checkpointer->count(), checkpointer->name().c_str());
+            }
+        }
+
+        Result result;
+        result.origin = origin;
+        result.best = best;
+        result.count = count;
+        result.used_time = used_time;
+        result.satisfied = best->peak_memory <= limit;
+        return result;
+    }
+
+};
+
+// Names of the strategy, objective and cost model, chosen at run time
+struct SearchPolicy {
+    std::string strategy = "best-first";
+    std::string objective = "balanced";
+    std::string cost = "balanced";
+
+    bool isDefault() const {
+        return strategy == "best-first" and objective == "balanced" and cost == "balanced";
+    }
+
+    std::string name() const {
+        return strategy + ", " + objective + " objective, " + cost + " cost";
+    }
+};
 
+// Dispatches to the instantiation of the policy, compiled in advance
+class Optimizer: public SearchBase {
+public:
+    static constexpr int BEAM_WIDTH = 64;
+
+private:
+    SearchPolicy policy;
+
+    template <typename Strategy, typename Objective>
+    Result searchCost(const ScheduleHandle &origin, bool verbose, uint64_t origin_time) const {
+        if (policy.cost == "balanced") {
+            return BasicOptimizer<Strategy, Objective, BalancedCost>(*this).search(origin, verbose, origin_time);
+        } else if (policy.cost == "memory") {
+            return BasicOptimizer<Strategy, Objective, MemoryCost>(*this).search(origin, verbose, origin_time);
+        }
+        error("Unknown cost model %s\n", policy.cost.c_str());
+        return Result();
+    }
+
+    template <typename Strategy>
+    Result searchObjective(const ScheduleHandle &origin, bool verbose, uint64_t origin_time) const {
+        if (policy.objective == "balanced") {
+            return searchCost<Strategy, BalancedObjective>(origin, verbose, origin_time);
+        } else if (policy.objective == "memory") {
+            return searchCost<Strategy, MemoryObjective>(origin, verbose, origin_time);
+        }
+        error("Unknown objective %s\n", policy.objective.c_str());
+        return Result();
+    }
+
+public:
+    explicit Optimizer(size_t limit, bool inplace=false, int search_limit=SEARCH_LIMIT, const Progress &progress=nullptr,
+                       const Applier &applier=nullptr, const std::shared_ptr<Checkpointer> &checkpointer=nullptr,
+                       const SearchPolicy &policy=SearchPolicy()):
+        SearchBase(limit, inplace, search_limit, progress, applier, checkpointer), policy(policy) {}
+
+    std::string name() const {
+        if (policy.isDefault()) {
+            return "optimizer (limit " + prettyBytes(limit) + ")";
+        }
+        return "optimizer (limit " + prettyBytes(limit) + ", " + policy.name() + ")";
+    }
+
+    // Slowdowns are relative to `origin_time`, the time of `origin` if zero (a search continuing an earlier one passes
+    // the time of the earlier origin)
+    Result search(const ScheduleHandle &origin, bool verbose=true, uint64_t origin_time=0) const {
+        if (policy.strategy == "best-first") {
+            return searchObjective<BestFirst>(origin, verbose, origin_time);
+        } else if (policy.strategy == "beam") {
+            return searchObjective<Beam<BEAM_WIDTH>>(origin, verbose, origin_time);
+        } else if (policy.strategy == "greedy") {
+            return searchObjective<Beam<1>>(origin, verbose, origin_time);
+        }
+        error("Unknown search strategy %s\n", policy.strategy.c_str());
+        return Result();
+    }
+
+    void optimize(const ScheduleHandle &origin, const std::string &output_path) const {
+        report(search(origin), output_path);
+    }
+
+    static void report(const Result &result, const std::string &output_path) {
         // Show best
         printf(" > Result:\n");
-        printf("   > Schedules searched: %d\n", count);
-        printf("   > Time used: %s\n", prettyNanoseconds(timer.tik()).c_str());
-        printf("   > Best: {%s}\n", best->info().c_str());
-        printf("   > Satisfy memory: %s\n", best->peak_memory <= limit ? "true" : "false");
+        printf("   > Schedules searched: %d\n", result.count);
+        printf("   > Time used: %s\n", prettyNanoseconds(result.used_time).c_str());
+        printf("   > Best: {%s}\n", result.best->info().c_str());
+        printf("   > Satisfy memory: %s\n", result.satisfied ? "true" : "false");
+        result.best->analyzeProfile();
+        auto &profile = result.best->profile;
+        std::stringstream peaks;
+        for (auto &peak: profile.peaks) {
+            peaks << (peaks.tellp() ? ", " : "") << "#" << peak.time_stamp << ": " << prettyBytes(peak.memory);
+        }
+        printf("   > Top peaks: {%s}\n", peaks.str().c_str());
+        for (auto &region: profile.regions) {
+            std::stringstream dominating;
+            for (auto &operand: region.dominating) {
+                dominating << (dominating.tellp() ? ", " : "") << operand->id << " (" << prettyBytes(operand->size) << ")";
+            }
+            printf("   > Above limit in [#%d, #%d]: peak %s at #%d, %s over, dominated by {%s}\n", region.begin, region.end,
+                   prettyBytes(region.peak.memory).c_str(), region.peak.time_stamp,
+                   prettyBytes(region.peak.memory - result.best->common->limit).c_str(), dominating.str().c_str());
+        }
 
         // Write result
         printf(" > Writing result into path %s ... ", output_path.c_str());
-        best->restoreAndDumpToFile(output_path);
+        result.best->restoreAndDumpToFile(output_path);
         printf("OK!\n");
     }
 };
\ No newline at end of file
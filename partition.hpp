@@ -0,0 +1,326 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdlib>
+#include <map>
+#include <set>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "optimizer.hpp"
+#include "schedule.hpp"
+#include "split.hpp"
+#include "timer.hpp"
+#include "utils.hpp"
+
+// A contiguous range of the schedule, optimized independently with its own operands
+struct Segment {
+    int begin = 0, end = 0;
+    size_t budget = 0, pass_through = 0;
+    ScheduleHandle schedule;
+    std::map<OperandHandle, OperandHandle> origin;
+    Optimizer::Result result;
+};
+
+class Partitioner {
+    // Expansions of the global search across the cuts after stitching
+    static constexpr int POLISH_SEARCH_LIMIT = 300;
+
+    size_t limit;
+    int segment_count;
+    bool inplace;
+
+    // Live bytes and count of operands crossing the cut after every task (the same simulation as `analyzeMemory`)
+    static void analyzeCuts(const ScheduleHandle &schedule, std::vector<size_t> &live_bytes, std::vector<int> &live_count) {
+        schedule->analyze();
+        auto &common = *schedule->common;
+        for (auto &operand: common.operands) {
+            operand->on_device = false;
+        }
+        size_t bytes = 0;
+        int count = 0;
+        for (auto &operand: common.already_on) {
+            operand->on_device = true;
+            bytes += operand->size;
+            ++ count;
+        }
+        LOOP(task, schedule->head) {
+            for (auto &usage: task->outs) {
+                if (not usage.operand->on_device) {
+                    usage.operand->on_device = true;
+                    bytes += usage.operand->size;
+                    ++ count;
+                }
+            }
+            for (auto &operand: task->to_dealloc_after) {
+                operand->on_device = false;
+                bytes -= operand->size;
+                -- count;
+            }
+            live_bytes.push_back(bytes);
+            live_count.push_back(count);
+        }
+    }
+
+    std::vector<int> cuts(const ScheduleHandle &schedule) const {
+        std::vector<size_t> live_bytes;
+        std::vector<int> live_count;
+        analyzeCuts(schedule, live_bytes, live_count);
+
+        // The narrowest cuts (lowest memory, then fewest operands) over the whole schedule, at least half of the even
+        // length apart so that no segment degenerates
+        int size = live_bytes.size();
+        int gap = std::max(1, size / (2 * segment_count));
+        std::vector<int> positions;
+        for (int p = gap; p + gap <= size; ++ p) {
+            positions.push_back(p);
+        }
+        // Cut after the (p - 1)-th task
+        std::stable_sort(positions.begin(), positions.end(), [&](int a, int b) {
+            return std::make_pair(live_bytes[a - 1], live_count[a - 1]) < std::make_pair(live_bytes[b - 1], live_count[b - 1]);
+        });
+        std::vector<int> cuts = {0, size};
+        for (int p: positions) {
+            if (static_cast<int>(cuts.size()) == segment_count + 1) {
+                break;
+            }
+            bool apart = true;
+            for (int cut: cuts) {
+                apart = apart and std::abs(p - cut) >= gap;
+            }
+            if (apart) {
+                cuts.push_back(p);
+            }
+        }
+        std::sort(cuts.begin(), cuts.end());
+        return cuts;
+    }
+
+    Segment build(const ScheduleHandle &schedule, const std::vector<TaskHandle> &tasks, int begin, int end,
+                  const std::map<OperandHandle, int> &last_read, const std::set<OperandHandle> &live) const {
+        auto &global = *schedule->common;
+        Segment segment;
+        segment.begin = begin, segment.end = end;
+        segment.schedule = std::make_shared<Schedule>();
+        auto common = segment.schedule->common = std::make_shared<Common>();
+        common->time_z = global.time_z;
+
+        // Clone operands and tasks, ids of clones are their indices in the segment
+        std::map<OperandHandle, OperandHandle> cloned;
+        auto clone = [&](const OperandHandle &operand) {
+            if (not cloned.count(operand)) {
+                auto new_operand = std::make_shared<Operand>(operand->size, static_cast<int>(common->operands.size()), nlohmann::json());
+                cloned[operand] = new_operand;
+                segment.origin[new_operand] = operand;
+                common->operands.push_back(new_operand);
+            }
+            return cloned[operand];
+        };
+        auto cloneUsages = [&](const TaskHandle &task) {
+            for (auto *usages: {&task->ins, &task->outs}) {
+                for (auto &usage: *usages) {
+                    usage.operand = clone(usage.operand);
+                }
+            }
+        };
+        TaskHandle tail;
+        std::set<OperandHandle> generated;
+        for (int i = begin; i < end; ++ i) {
+            auto new_task = tasks[i]->copy();
+            for (auto &fused: new_task->fused) {
+                fused = fused->copy();
+                cloneUsages(fused);
+            }
+            if (new_task->origin_names) {
+                new_task->origin_names = new_task->origin_names->copy();
+                cloneUsages(new_task->origin_names);
+            }
+            // Live-ins are pinned on device
+            for (auto &usage: new_task->ins) {
+                if (not generated.count(usage.operand)) {
+                    generated.insert(usage.operand);
+                    common->already_on.insert(clone(usage.operand));
+                }
+                usage.operand = clone(usage.operand);
+            }
+            for (auto &usage: new_task->outs) {
+                generated.insert(usage.operand);
+                usage.operand = clone(usage.operand);
+            }
+            if (not tail) {
+                segment.schedule->head = new_task;
+            } else {
+                tail->next = new_task;
+                new_task->prev = tail;
+            }
+            tail = new_task;
+        }
+
+        // Live-outs are pinned as not deallocated
+        for (auto &item: cloned) {
+            auto it = last_read.find(item.first);
+            if (global.not_dealloc.count(item.first) or (it != last_read.end() and it->second >= end)) {
+                common->not_dealloc.insert(item.second);
+            }
+        }
+
+        // Operands living through the whole segment take the budget
+        for (auto &operand: live) {
+            if (not cloned.count(operand)) {
+                segment.pass_through += operand->size;
+            }
+        }
+        segment.budget = limit > segment.pass_through ? limit - segment.pass_through : 0;
+
+        // Origin names of `.share` views used by the segment's tasks, on the clones (restored by in-place checks)
+        LOOP(task, segment.schedule->head) {
+            auto it = global.real_task.find(task->id);
+            if (it != global.real_task.end()) {
+                auto backup = it->second->copy();
+                cloneUsages(backup);
+                common->real_task[task->id] = backup;
+            }
+        }
+
+        // The split model on the clones, batched as their origin operands
+        if (global.split) {
+            auto model = std::make_shared<SplitModel>(*global.split);
+            model->batched.assign(common->operands.size(), false);
+            for (auto &item: cloned) {
+                if (static_cast<size_t>(item.first->id) < global.split->batched.size()) {
+                    model->batched[item.second->id] = global.split->batched[item.first->id];
+                }
+            }
+            common->split = model;
+        }
+        return segment;
+    }
+
+    ScheduleHandle stitch(const ScheduleHandle &schedule, std::vector<Segment> &segments) const {
+        auto new_schedule = std::make_shared<Schedule>();
+        new_schedule->common = schedule->common;
+        TaskHandle tail;
+        for (auto &segment: segments) {
+            auto originUsages = [&segment](const TaskHandle &task) {
+                for (auto *usages: {&task->ins, &task->outs}) {
+                    for (auto &usage: *usages) {
+                        auto it = segment.origin.find(usage.operand);
+                        usage.operand = it == segment.origin.end() ? usage.operand : it->second;
+                    }
+                }
+            };
+            LOOP(task, segment.result.best->head) {
+                auto new_task = task->copy();
+                originUsages(new_task);
+                for (auto &fused: new_task->fused) {
+                    fused = fused->copy();
+                    originUsages(fused);
+                }
+                // Origin names recorded by in-place rewrites inside the segment
+                if (new_task->origin_names) {
+                    new_task->origin_names = new_task->origin_names->copy();
+                    originUsages(new_task->origin_names);
+                }
+                if (not tail) {
+                    new_schedule->head = new_task;
+                } else {
+                    tail->next = new_task;
+                    new_task->prev = tail;
+                }
+                tail = new_task;
+            }
+        }
+        return new_schedule;
+    }
+
+public:
+    Partitioner(size_t limit, int segment_count, bool inplace=false):
+        limit(limit), segment_count(segment_count), inplace(inplace) {}
+
+    Optimizer::Result optimize(const ScheduleHandle &origin) const {
+        Timer timer;
+        auto cut_positions = cuts(origin);
+
+        // Last reading position and live operands at every cut
+        std::vector<TaskHandle> tasks;
+        std::map<OperandHandle, int> last_read;
+        std::vector<std::set<OperandHandle>> lives;
+        std::set<OperandHandle> live(origin->common->already_on.begin(), origin->common->already_on.end());
+        int next_cut = 0;
+        LOOP(task, origin->head) {
+            if (next_cut < cut_positions.size() and tasks.size() == cut_positions[next_cut]) {
+                lives.push_back(live);
+                ++ next_cut;
+            }
+            for (auto &usage: task->ins) {
+                last_read[usage.operand] = tasks.size();
+            }
+            for (auto &usage: task->outs) {
+                live.insert(usage.operand);
+            }
+            for (auto &operand: task->to_dealloc_after) {
+                live.erase(operand);
+            }
+            tasks.push_back(task);
+        }
+
+        // Build and optimize segments in parallel
+        std::vector<Segment> segments;
+        for (int i = 0; i + 1 < cut_positions.size(); ++ i) {
+            segments.push_back(build(origin, tasks, cut_positions[i], cut_positions[i + 1], last_read, lives[i]));
+        }
+        printf(" > Partitioned into %zu segments\n", segments.size());
+        std::vector<std::thread> threads;
+        for (auto &segment: segments) {
+            threads.emplace_back([this, &segment]() {
+                segment.result = Optimizer(segment.budget, inplace).search(segment.schedule, false);
+            });
+        }
+        for (auto &thread: threads) {
+            thread.join();
+        }
+        for (auto &segment: segments) {
+            auto &result = segment.result;
+            printf("   > Segment [%d, %d): budget %s (%s passing through), searched %d, best {%s}, satisfy memory: %s\n",
+                   segment.begin, segment.end, prettyBytes(segment.budget).c_str(), prettyBytes(segment.pass_through).c_str(),
+                   result.count, result.best->info().c_str(), result.satisfied ? "true" : "false");
+        }
+
+        // Stitch and polish globally, re-computations across the cuts are only found there
+        auto stitched = stitch(origin, segments);
+        uint64_t origin_time = origin->analyze().second;
+        auto polished = Optimizer(limit, inplace, POLISH_SEARCH_LIMIT).search(stitched, false, origin_time);
+        printf(" > Stitched {%s}, polished in %d schedules {%s}\n", stitched->info().c_str(), polished.count,
+               polished.best->info().c_str());
+
+        // Pinned boundaries may leave the stitched schedule worse than a plain search, which is given the same time
+        uint64_t partitioned_time = timer.tik(), plain_time = 0;
+        Timer plain_timer;
+        auto within = [&](int, const ScheduleHandle&) {
+            plain_time += plain_timer.tik();
+            return plain_time < partitioned_time;
+        };
+        auto plain = Optimizer(limit, inplace, Optimizer::SEARCH_LIMIT, within).search(origin, false);
+        auto comparator = Comparator{origin_time, limit};
+        Optimizer::Result result;
+        result.origin = origin;
+        result.best = polished.best;
+        std::string kept = "partitioned";
+        if (comparator(result.best, plain.best)) {
+            result.best = plain.best, kept = "plain search";
+        }
+        if (comparator(result.best, origin)) {
+            result.best = origin, kept = "origin";
+        }
+        printf(" > Plain search in the same time: %d schedules {%s}, keeping the %s result\n", plain.count,
+               plain.best->info().c_str(), kept.c_str());
+        result.count = polished.count + plain.count;
+        for (auto &segment: segments) {
+            result.count += segment.result.count;
+        }
+        result.used_time = partitioned_time + timer.tik();
+        result.satisfied = result.best->peak_memory <= limit;
+        return result;
+    }
+};
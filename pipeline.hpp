@@ -0,0 +1,203 @@
+#pragma once
+
+#include <fstream>
+#include <map>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "json.hpp"
+#include "optimizer.hpp"
+#include "schedule.hpp"
+#include "utils.hpp"
+
+// A pipeline stage is a set of slices (ranges in `code`) of the whole trace,
+// e.g. the forward and the backward part of the layers placed on one device
+struct Stage {
+    int id = 0;
+    std::vector<std::pair<int, int>> ranges;
+    size_t limit = 0;
+    int in_flight = 1;
+
+    // Filled after loading
+    ScheduleHandle schedule;
+    int count = 0;
+    size_t stashed_memory = 0;
+    Optimizer::Result result;
+};
+
+class Pipeline {
+    std::string config_path;
+    std::vector<Stage> stages;
+    int micro_batches = 1;
+
+    static nlohmann::json slice(const nlohmann::json &json, const Stage &stage, std::vector<int> &range_ends) {
+        nlohmann::json sliced;
+        sliced["data"] = json["data"];
+        sliced["inputs"] = json["inputs"];
+        sliced["outputs"] = json["outputs"];
+        sliced["version"] = json["version"];
+        sliced["code"] = nlohmann::json::array();
+        auto &code = sliced["code"];
+
+        // Copy tasks, .dealloc of operands which never appear in this stage should be dropped
+        std::set<int> appeared;
+        for (auto &range: stage.ranges) {
+            for (int i = range.first; i < range.second; ++ i) {
+                auto item = json["code"][i];
+                if (item["name"] == ".dealloc") {
+                    auto outs = nlohmann::json::array();
+                    for (auto &id: item["outs"]) {
+                        if (appeared.count(static_cast<int>(id))) {
+                            outs.push_back(id);
+                        }
+                    }
+                    if (outs.empty()) {
+                        continue;
+                    }
+                    item["outs"] = outs;
+                } else {
+                    for (auto &id: item["ins"]) {
+                        appeared.insert(static_cast<int>(id));
+                    }
+                    for (auto &id: item["outs"]) {
+                        appeared.insert(static_cast<int>(id));
+                    }
+                }
+                code.push_back(item);
+            }
+            range_ends.push_back(code.size());
+        }
+        return sliced;
+    }
+
+    static size_t scaleStashed(Stage &stage, const std::vector<int> &range_ends) {
+        // Task id is the 1-based index in the sliced `code`
+        auto range_of = [&range_ends](int id) {
+            return static_cast<int>(std::upper_bound(range_ends.begin(), range_ends.end(), id - 1) - range_ends.begin());
+        };
+
+        // Activations generated in one range and used in a later one (forward to backward)
+        // are held once for every in-flight micro-batch
+        auto &common = stage.schedule->common;
+        std::map<OperandHandle, int> gen_range, last_range;
+        LOOP(task, stage.schedule->head) {
+            int range = range_of(task->id);
+            for (auto &usage: task->ins) {
+                last_range[usage.operand] = range;
+            }
+            for (auto &usage: task->outs) {
+                if (not gen_range.count(usage.operand)) {
+                    gen_range[usage.operand] = range;
+                }
+            }
+        }
+        size_t stashed = 0;
+        for (auto &item: gen_range) {
+            auto &operand = item.first;
+            if (common->already_on.count(operand) or common->not_dealloc.count(operand)) {
+                continue;
+            }
+            if (last_range.count(operand) and last_range[operand] > item.second) {
+                stashed += operand->size;
+                operand->size *= stage.in_flight;
+            }
+        }
+        return stashed;
+    }
+
+public:
+    explicit Pipeline(const std::string &config_path): config_path(config_path) {}
+
+    void load() {
+        // Read config
+        std::ifstream config_file(config_path);
+        if (not config_file) {
+            error("Failed to open pipeline config %s\n", config_path.c_str());
+        }
+        nlohmann::json config;
+        config_file >> config;
+        micro_batches = config.value("micro_batches", 1);
+        if (micro_batches < 1) {
+            error("Micro-batch count should be positive\n");
+        }
+
+        // Read pattern
+        std::string pattern_path = config["pattern"];
+        std::ifstream pattern_file(pattern_path);
+        if (not pattern_file) {
+            error("Failed to open pattern %s\n", pattern_path.c_str());
+        }
+        nlohmann::json pattern;
+        pattern_file >> pattern;
+        int code_size = pattern["code"].size();
+
+        // Stages, every stage has its own operands because they run on different devices (and threads)
+        int stage_count = config["stages"].size();
+        for (int i = 0; i < stage_count; ++ i) {
+            auto &stage_json = config["stages"][i];
+            Stage stage;
+            stage.id = i;
+            for (auto &range: stage_json["ranges"]) {
+                int begin = range[0], end = range[1];
+                if (begin < 0 or end > code_size or begin >= end) {
+                    error("Invalid range [%d, %d) in stage %d\n", begin, end, i);
+                }
+                stage.ranges.emplace_back(begin, end);
+            }
+            stage.limit = Unit::fromText(stage_json["limit"]);
+            // 1F1B schedule: the i-th stage keeps at most (stages - i) micro-batches in flight
+            stage.in_flight = stage_json.value("in_flight", std::min(micro_batches, stage_count - i));
+
+            std::vector<int> range_ends;
+            auto sliced = slice(pattern, stage, range_ends);
+            auto name = pattern_path + " (stage " + std::to_string(i) + ")";
+            std::tie(stage.schedule, stage.count) = Schedule::fromJson(sliced, name);
+            stage.stashed_memory = scaleStashed(stage, range_ends);
+            stages.push_back(stage);
+        }
+    }
+
+    void optimize(const std::string &output_prefix) {
+        printf("Running pipeline %s (%zu stages, %d micro-batches) ... \n", config_path.c_str(), stages.size(), micro_batches);
+        for (auto &stage: stages) {
+            printf(" > Stage %d: %d operators, limit %s, %d in flight, stashed activations %s\n", stage.id, stage.count,
+                   prettyBytes(stage.limit).c_str(), stage.in_flight, prettyBytes(stage.stashed_memory).c_str());
+        }
+
+        // Optimize all stages concurrently
+        Timer timer;
+        std::vector<std::thread> threads;
+        for (auto &stage: stages) {
+            threads.emplace_back([&stage]() {
+                stage.result = Optimizer(stage.limit).search(stage.schedule, false);
+            });
+        }
+        for (auto &thread: threads) {
+            thread.join();
+        }
+
+        // Combined report
+        uint64_t bottleneck = 0;
+        bool satisfied = true;
+        printf(" > Result (time used: %s):\n", prettyNanoseconds(timer.tik()).c_str());
+        for (auto &stage: stages) {
+            auto &result = stage.result;
+            printf("   > Stage %d: searched %d, origin {%s}, best {%s}, satisfy memory: %s\n", stage.id, result.count,
+                   result.origin->info().c_str(), result.best->info().c_str(), result.satisfied ? "true" : "false");
+            bottleneck = std::max(bottleneck, result.best->total_time);
+            satisfied = satisfied and result.satisfied;
+        }
+        printf("   > Bottleneck stage time: %s\n", prettyNanoseconds(bottleneck).c_str());
+        printf("   > Estimated step time: %s\n", prettyNanoseconds(bottleneck * (micro_batches + stages.size() - 1)).c_str());
+        printf("   > Satisfy memory: %s\n", satisfied ? "true" : "false");
+
+        // Write results
+        for (auto &stage: stages) {
+            auto path = output_prefix + ".stage" + std::to_string(stage.id) + ".json";
+            printf(" > Writing stage %d into path %s ... ", stage.id, path.c_str());
+            stage.result.best->restoreAndDumpToFile(path);
+            printf("OK!\n");
+        }
+    }
+};
@@ -0,0 +1,185 @@
+#pragma once
+
+#include <algorithm>
+#include <fstream>
+#include <iterator>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "json.hpp"
+#include "utils.hpp"
+
+// Parses pattern files with the elements of the large top-level arrays (`code` and `data`) parsed concurrently in
+// contiguous chunks, their boundaries found by a structural scan. The result equals a sequential parse, and text the
+// scan does not understand is parsed sequentially (so malformed files fail with the usual message)
+class PatternReader {
+    static constexpr int PARALLEL_ELEMENTS = 4096;
+
+    typedef std::pair<size_t, size_t> Span;
+
+    // A top-level field, with the spans of its elements if it is a large array
+    struct Field {
+        std::string key;
+        Span value;
+        bool split = false;
+        std::vector<Span> elements;
+    };
+
+    const std::string &text;
+    size_t pos = 0;
+
+    void skipSpaces() {
+        while (pos < text.size() and std::isspace(static_cast<unsigned char>(text[pos]))) {
+            ++ pos;
+        }
+    }
+
+    bool expect(char c) {
+        skipSpaces();
+        if (pos < text.size() and text[pos] == c) {
+            ++ pos;
+            return true;
+        }
+        return false;
+    }
+
+    // Moves to the end of the (non-empty) value at `pos`, only strings and brackets are tracked, the parser checks the rest
+    bool skipValue() {
+        skipSpaces();
+        size_t begin = pos;
+        int depth = 0;
+        bool in_string = false;
+        for (; pos < text.size(); ++ pos) {
+            char c = text[pos];
+            if (in_string) {
+                if (c == '\\') {
+                    ++ pos;
+                } else if (c == '"') {
+                    in_string = false;
+                    if (depth == 0) {
+                        ++ pos;
+                        return true;
+                    }
+                }
+            } else if (c == '"') {
+                in_string = true;
+            } else if (c == '[' or c == '{') {
+                ++ depth;
+            } else if (depth == 0 and (c == ']' or c == '}' or c == ',' or c == ':' or std::isspace(static_cast<unsigned char>(c)))) {
+                // End of a scalar
+                return pos > begin;
+            } else if ((c == ']' or c == '}') and -- depth == 0) {
+                ++ pos;
+                return true;
+            }
+        }
+        return pos > begin and depth == 0 and not in_string;
+    }
+
+    bool scanArray(Field &field) {
+        if (not expect('[')) {
+            return false;
+        }
+        if (expect(']')) {
+            return true;
+        }
+        do {
+            skipSpaces();
+            size_t begin = pos;
+            if (not skipValue()) {
+                return false;
+            }
+            field.elements.emplace_back(begin, pos);
+        } while (expect(','));
+        return expect(']');
+    }
+
+    bool scan(std::vector<Field> &fields) {
+        if (not expect('{')) {
+            return false;
+        }
+        if (expect('}')) {
+            skipSpaces();
+            return pos == text.size();
+        }
+        do {
+            Field field;
+            skipSpaces();
+            size_t begin = pos;
+            if (pos >= text.size() or text[pos] != '"' or not skipValue()) {
+                return false;
+            }
+            field.key = nlohmann::json::parse(text.begin() + begin, text.begin() + pos).get<std::string>();
+            if (not expect(':')) {
+                return false;
+            }
+            skipSpaces();
+            begin = pos;
+            field.split = (field.key == "code" or field.key == "data") and pos < text.size() and text[pos] == '[';
+            if (not (field.split ? scanArray(field) : skipValue())) {
+                return false;
+            }
+            field.value = Span(begin, pos);
+            fields.push_back(field);
+        } while (expect(','));
+        if (not expect('}')) {
+            return false;
+        }
+        skipSpaces();
+        return pos == text.size();
+    }
+
+    nlohmann::json value(const Span &span) const {
+        return nlohmann::json::parse(text.begin() + span.first, text.begin() + span.second);
+    }
+
+    explicit PatternReader(const std::string &text): text(text) {}
+
+public:
+    static nlohmann::json parse(const std::string &text, int threads=std::thread::hardware_concurrency()) {
+        PatternReader reader(text);
+        std::vector<Field> fields;
+        if (not reader.scan(fields)) {
+            return nlohmann::json::parse(text);
+        }
+        nlohmann::json json = nlohmann::json::object();
+        for (auto &field: fields) {
+            if (not field.split) {
+                json[field.key] = reader.value(field.value);
+                continue;
+            }
+            int count = field.elements.size();
+            int chunks = std::max(1, std::min(threads, count / PARALLEL_ELEMENTS));
+            std::vector<nlohmann::json> items(count);
+            std::vector<char> failed(chunks, false);
+            parallelFor(chunks, [&](int chunk) {
+                int begin = static_cast<long long>(count) * chunk / chunks, end = static_cast<long long>(count) * (chunk + 1) / chunks;
+                try {
+                    for (int i = begin; i < end; ++ i) {
+                        items[i] = reader.value(field.elements[i]);
+                    }
+                } catch (const nlohmann::json::exception&) {
+                    // Reported by the sequential parse
+                    failed[chunk] = true;
+                }
+            });
+            if (std::count(failed.begin(), failed.end(), true)) {
+                return nlohmann::json::parse(text);
+            }
+            json[field.key] = nlohmann::json::array_t(std::make_move_iterator(items.begin()), std::make_move_iterator(items.end()));
+        }
+        return json;
+    }
+
+    static nlohmann::json fromFile(const std::string &path, int threads=std::thread::hardware_concurrency()) {
+        std::ifstream file(path);
+        if (not file) {
+            error("Failed to open %s\n", path.c_str());
+        }
+        std::stringstream buffer;
+        buffer << file.rdbuf();
+        return parse(buffer.str(), threads);
+    }
+};
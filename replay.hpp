@@ -0,0 +1,473 @@
+#pragma once
+
+#include <algorithm>
+#include <fstream>
+#include <functional>
+#include <map>
+#include <memory>
+#include <set>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <malloc.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "json.hpp"
+#include "reader.hpp"
+#include "schedule.hpp"
+#include "timer.hpp"
+#include "utils.hpp"
+
+// Host allocators behind the replay
+class Allocator {
+public:
+    static constexpr size_t ALIGNMENT = 512;
+
+    virtual ~Allocator() = default;
+
+    virtual std::string name() const = 0;
+
+    virtual void *allocate(size_t size) = 0;
+
+    virtual void release(void *ptr, size_t size) = 0;
+
+    // Most bytes held from the system at the same time
+    virtual size_t highWater() const = 0;
+
+    // Simulated allocators return addresses without memory behind
+    virtual bool simulated() const {
+        return false;
+    }
+
+    static size_t align(size_t size, size_t alignment=ALIGNMENT) {
+        return (size + alignment - 1) / alignment * alignment;
+    }
+
+    static std::unique_ptr<Allocator> create(const std::string &name, size_t capacity);
+};
+
+class MallocAllocator: public Allocator {
+    size_t in_use = 0, high_water = 0;
+
+public:
+    std::string name() const override {
+        return "malloc";
+    }
+
+    void *allocate(size_t size) override {
+        void *ptr = malloc(size);
+        if (not ptr) {
+            error("Failed to allocate %s with malloc\n", prettyBytes(size).c_str());
+        }
+        in_use += malloc_usable_size(ptr);
+        high_water = std::max(high_water, in_use);
+        return ptr;
+    }
+
+    void release(void *ptr, size_t size) override {
+        in_use -= malloc_usable_size(ptr);
+        free(ptr);
+    }
+
+    size_t highWater() const override {
+        return high_water;
+    }
+};
+
+// First-fit over one reserved region, the high water is the furthest end ever used
+class ArenaAllocator: public Allocator {
+    char *base = nullptr;
+    size_t capacity, high_water = 0;
+    std::map<size_t, size_t> free_blocks;
+
+public:
+    explicit ArenaAllocator(size_t capacity): capacity(align(capacity, 4096)) {
+        void *ptr = mmap(nullptr, this->capacity, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (ptr == MAP_FAILED) {
+            error("Failed to reserve an arena of %s\n", prettyBytes(this->capacity).c_str());
+        }
+        base = static_cast<char*>(ptr);
+        free_blocks[0] = this->capacity;
+    }
+
+    ~ArenaAllocator() override {
+        munmap(base, capacity);
+    }
+
+    std::string name() const override {
+        return "arena";
+    }
+
+    void *allocate(size_t size) override {
+        size = align(size);
+        for (auto it = free_blocks.begin(); it != free_blocks.end(); ++ it) {
+            if (it->second >= size) {
+                size_t offset = it->first, remaining = it->second - size;
+                free_blocks.erase(it);
+                if (remaining) {
+                    free_blocks[offset + size] = remaining;
+                }
+                high_water = std::max(high_water, offset + size);
+                return base + offset;
+            }
+        }
+        error("Arena of %s exhausted\n", prettyBytes(capacity).c_str());
+        return nullptr;
+    }
+
+    void release(void *ptr, size_t size) override {
+        size_t offset = static_cast<char*>(ptr) - base;
+        size = align(size);
+
+        // Coalesce with neighbours
+        auto next = free_blocks.lower_bound(offset);
+        if (next != free_blocks.end() and offset + size == next->first) {
+            size += next->second;
+            next = free_blocks.erase(next);
+        }
+        if (next != free_blocks.begin()) {
+            auto prev = std::prev(next);
+            if (prev->first + prev->second == offset) {
+                prev->second += size;
+                return;
+            }
+        }
+        free_blocks[offset] = size;
+    }
+
+    size_t highWater() const override {
+        return high_water;
+    }
+};
+
+// The essentials of a framework caching allocator: segments are cached and never returned, small requests share
+// 2 MiB segments, and blocks are best-fit, split and merged inside their segments
+class CachingAllocator: public Allocator {
+    static constexpr size_t SMALL_SIZE = 1ull << 20;
+    static constexpr size_t SMALL_SEGMENT = 2ull << 20;
+    static constexpr size_t LARGE_ROUND = 2ull << 20;
+
+    struct Block {
+        size_t segment, size;
+        bool small, used;
+    };
+
+    size_t reserved = 0, next_address = ALIGNMENT;
+    // Address to block, addresses of different segments never touch
+    std::map<size_t, Block> blocks;
+    // Free blocks of both pools by (size, address)
+    std::set<std::pair<size_t, size_t>> small_pool, large_pool;
+
+public:
+    std::string name() const override {
+        return "caching";
+    }
+
+    bool simulated() const override {
+        return true;
+    }
+
+    void *allocate(size_t size) override {
+        size = align(std::max<size_t>(size, 1));
+        bool small = size <= SMALL_SIZE;
+        auto &pool = small ? small_pool : large_pool;
+        auto it = pool.lower_bound(std::make_pair(size, static_cast<size_t>(0)));
+        size_t address;
+        if (it == pool.end()) {
+            // New segment, separated from the previous ones by a gap
+            size_t segment_size = small ? SMALL_SEGMENT : align(size, LARGE_ROUND);
+            address = next_address;
+            next_address += segment_size + ALIGNMENT;
+            reserved += segment_size;
+            blocks[address] = Block {address, segment_size, small, false};
+            pool.insert(std::make_pair(segment_size, address));
+            it = pool.find(std::make_pair(segment_size, address));
+        }
+        address = it->second;
+        pool.erase(it);
+        auto &block = blocks[address];
+        size_t remaining = block.size - size;
+        if (remaining >= (small ? ALIGNMENT : SMALL_SIZE)) {
+            blocks[address + size] = Block {block.segment, remaining, small, false};
+            pool.insert(std::make_pair(remaining, address + size));
+            block.size = size;
+        }
+        block.used = true;
+        return reinterpret_cast<void*>(address);
+    }
+
+    void release(void *ptr, size_t size) override {
+        size_t address = reinterpret_cast<size_t>(ptr);
+        auto it = blocks.find(address);
+        auto &pool = it->second.small ? small_pool : large_pool;
+        it->second.used = false;
+
+        // Merge with free neighbours of the same segment
+        auto next = std::next(it);
+        if (next != blocks.end() and not next->second.used and next->second.segment == it->second.segment) {
+            pool.erase(std::make_pair(next->second.size, next->first));
+            it->second.size += next->second.size;
+            blocks.erase(next);
+        }
+        if (it != blocks.begin()) {
+            auto prev = std::prev(it);
+            if (not prev->second.used and prev->second.segment == it->second.segment) {
+                pool.erase(std::make_pair(prev->second.size, prev->first));
+                prev->second.size += it->second.size;
+                blocks.erase(it);
+                it = prev;
+            }
+        }
+        pool.insert(std::make_pair(it->second.size, it->first));
+    }
+
+    size_t highWater() const override {
+        return reserved;
+    }
+};
+
+std::unique_ptr<Allocator> Allocator::create(const std::string &name, size_t capacity) {
+    if (name == "malloc") {
+        return std::unique_ptr<Allocator>(new MallocAllocator());
+    } else if (name == "arena") {
+        return std::unique_ptr<Allocator>(new ArenaAllocator(capacity));
+    } else if (name == "caching") {
+        return std::unique_ptr<Allocator>(new CachingAllocator());
+    }
+    error("Allocator should be malloc, arena or caching\n");
+    return nullptr;
+}
+
+struct ReplayResult {
+    int entries = 0, unmatched = 0;
+    // `predicted_peak` is the optimizer's `peak_memory` of the program, `live_peak` the live bytes counted by the replay
+    size_t predicted_peak = 0, live_peak = 0, high_water = 0, rss_peak = 0;
+    uint64_t used_time = 0;
+};
+
+// Executes an optimized output on the host: operands and workspaces are allocated, `.share` views alias their
+// sources and storages are released with their last alias
+class Replayer {
+    std::string allocator_name;
+    bool touch;
+
+    static size_t residentBytes() {
+        std::ifstream file("/proc/self/statm");
+        size_t total = 0, resident = 0;
+        file >> total >> resident;
+        return resident * sysconf(_SC_PAGESIZE);
+    }
+
+    // Micro-tasks of split operators match the origin operator
+    static std::string signature(const nlohmann::json &item) {
+        if (not item.count("attr")) {
+            return item["name"];
+        }
+        auto attr = item["attr"];
+        if (attr.is_object()) {
+            attr.erase("split");
+        }
+        return item["name"].get<std::string>() + attr.dump();
+    }
+
+public:
+    Replayer(const std::string &allocator_name, bool touch): allocator_name(allocator_name), touch(touch) {}
+
+    static Replayer fromArguments(const std::vector<std::string> &arguments) {
+        std::string allocator_name = "malloc";
+        bool touch = false;
+        for (auto &argument: arguments) {
+            auto pos = argument.find('=');
+            auto key = argument.substr(0, pos);
+            auto value = pos == std::string::npos ? "" : argument.substr(pos + 1);
+            if (key == "--allocator") {
+                allocator_name = value;
+            } else if (key == "--touch") {
+                touch = true;
+            } else {
+                error("Unknown option %s\n", argument.c_str());
+            }
+        }
+        return Replayer(allocator_name, touch);
+    }
+
+    // Sizes and workspaces are taken from the input pattern, the output does not carry them
+    ReplayResult replay(const std::string &input, const std::string &output) const {
+        Timer timer;
+        ReplayResult result;
+        auto pattern = PatternReader::fromFile(input), program = PatternReader::fromFile(output);
+        std::vector<size_t> sizes;
+        for (auto &item: pattern["data"]) {
+            int id = item["id"];
+            if (id >= sizes.size()) {
+                sizes.resize(id + 1);
+            }
+            sizes[id] = item["size"];
+        }
+        std::unordered_map<std::string, size_t> workspaces;
+        size_t capacity = 0, max_workspace = 0;
+        for (auto &item: pattern["code"]) {
+            size_t workspace = item["workspace"];
+            workspaces[signature(item)] = workspace;
+            max_workspace = std::max(max_workspace, workspace);
+        }
+        auto workspaceOf = [&workspaces](const nlohmann::json &item, bool &matched) -> size_t {
+            auto it = workspaces.find(signature(item));
+            matched = it != workspaces.end();
+            if (not matched) {
+                return 0;
+            }
+            int count = item.count("attr") and item["attr"].count("split") ? item["attr"]["split"]["count"].get<int>() : 1;
+            return (it->second + count - 1) / count;
+        };
+
+        // The program analyzed as the optimizer does, with the workspaces of the pattern
+        nlohmann::json analyzed = {{"code", nlohmann::json::array()}, {"data", pattern["data"]}, {"inputs", pattern["inputs"]},
+                                   {"outputs", pattern["outputs"]}, {"version", pattern["version"]}};
+        for (auto &item: program["code"]) {
+            bool matched;
+            bool special = item["name"] == ".dealloc" or item["name"] == ".share";
+            analyzed["code"].push_back({{"name", item["name"]}, {"ins", item["ins"]}, {"outs", item["outs"]},
+                                        {"attr", item.count("attr") ? item["attr"] : nlohmann::json()},
+                                        {"workspace", special ? 0 : workspaceOf(item, matched)}, {"time", 0}});
+        }
+        auto schedule = Schedule::fromJson(analyzed, output).first;
+        result.predicted_peak = schedule->analyze().first;
+        for (size_t size: sizes) {
+            capacity += Allocator::align(size);
+        }
+        auto allocator = Allocator::create(allocator_name, capacity + Allocator::align(max_workspace) + Allocator::ALIGNMENT);
+        bool touching = touch and not allocator->simulated();
+        auto fill = [touching](void *ptr, size_t size) {
+            if (touching) {
+                for (size_t offset = 0; offset < size; offset += 4096) {
+                    static_cast<volatile char*>(ptr)[offset] = 1;
+                }
+            }
+        };
+
+        // Storages with their aliases alive
+        struct Storage {
+            void *ptr = nullptr;
+            size_t size = 0;
+            int aliases = 0;
+        };
+        std::vector<std::shared_ptr<Storage>> storage(sizes.size());
+        size_t current = 0, baseline = residentBytes();
+        auto acquire = [&](int id) {
+            if (not storage[id]) {
+                auto new_storage = std::make_shared<Storage>();
+                new_storage->size = sizes[id];
+                new_storage->ptr = sizes[id] ? allocator->allocate(sizes[id]) : nullptr;
+                fill(new_storage->ptr, sizes[id]);
+                current += sizes[id];
+                storage[id] = new_storage;
+                ++ new_storage->aliases;
+            }
+        };
+        auto drop = [&](int id) {
+            auto dropped = storage[id];
+            if (not dropped) {
+                error("Replay frees operand %d which is not on device\n", id);
+            }
+            storage[id] = nullptr;
+            if (-- dropped->aliases == 0) {
+                if (dropped->ptr) {
+                    allocator->release(dropped->ptr, dropped->size);
+                }
+                current -= dropped->size;
+            }
+        };
+        auto sample = [&]() {
+            if (touching) {
+                size_t resident = residentBytes();
+                result.rss_peak = std::max(result.rss_peak, resident > baseline ? resident - baseline : 0);
+            }
+        };
+
+        // Operands read before written are on device from the beginning (`Common::analyzePlacement`)
+        std::vector<bool> written(sizes.size());
+        for (auto &item: program["code"]) {
+            if (item["name"] == ".dealloc") {
+                continue;
+            }
+            for (int id: item["ins"]) {
+                if (not written[id] and not storage[id]) {
+                    acquire(id);
+                }
+            }
+            for (int id: item["outs"]) {
+                written[id] = true;
+            }
+        }
+        result.live_peak = current;
+        sample();
+
+        for (auto &item: program["code"]) {
+            ++ result.entries;
+            std::string name = item["name"];
+            if (name == ".dealloc") {
+                for (int id: item["outs"]) {
+                    drop(id);
+                }
+                continue;
+            }
+            if (name == ".share") {
+                int source = item["ins"][0], view = item["outs"][0];
+                if (storage[view] != storage[source]) {
+                    if (storage[view]) {
+                        drop(view);
+                    }
+                    storage[view] = storage[source];
+                    ++ storage[view]->aliases;
+                }
+                continue;
+            }
+            for (int id: item["ins"]) {
+                if (not storage[id]) {
+                    error("Replay reads operand %d which is not on device\n", id);
+                }
+            }
+            for (int id: item["outs"]) {
+                acquire(id);
+            }
+            bool matched;
+            size_t workspace = workspaceOf(item, matched);
+            result.unmatched += not matched;
+            void *workspace_ptr = workspace ? allocator->allocate(workspace) : nullptr;
+            fill(workspace_ptr, workspace);
+            result.live_peak = std::max(result.live_peak, current + workspace);
+            sample();
+            if (workspace_ptr) {
+                allocator->release(workspace_ptr, workspace);
+            }
+        }
+        result.high_water = allocator->highWater();
+        result.used_time = timer.tik();
+        return result;
+    }
+
+    void run(const std::string &input, const std::string &output) const {
+        printf("Replaying %s (sizes from %s) with the %s allocator ... \n", output.c_str(), input.c_str(), allocator_name.c_str());
+        auto result = replay(input, output);
+        auto compare = [&result](size_t bytes) {
+            bool above = bytes >= result.predicted_peak;
+            auto delta = prettyBytes(above ? bytes - result.predicted_peak : result.predicted_peak - bytes);
+            char buffer[64];
+            snprintf(buffer, sizeof(buffer), "%s%s, %.2f%% of predicted", above ? "+" : "-", delta.c_str(),
+                     result.predicted_peak ? 100.0 * bytes / result.predicted_peak : 0.0);
+            return std::string(buffer);
+        };
+        printf(" > Result:\n");
+        printf("   > Entries: %d (%d operators without a workspace match)\n", result.entries, result.unmatched);
+        printf("   > Time used: %s\n", prettyNanoseconds(result.used_time).c_str());
+        printf("   > Predicted peak (optimizer): %s\n", prettyBytes(result.predicted_peak).c_str());
+        printf("   > Replayed live peak: %s (%s)\n", prettyBytes(result.live_peak).c_str(), compare(result.live_peak).c_str());
+        printf("   > Allocator high water: %s (%s)\n", prettyBytes(result.high_water).c_str(), compare(result.high_water).c_str());
+        if (touch and result.rss_peak) {
+            printf("   > Peak RSS growth: %s (%s)\n", prettyBytes(result.rss_peak).c_str(), compare(result.rss_peak).c_str());
+        }
+    }
+};
@@ -0,0 +1,240 @@
+#pragma once
+
+#include <algorithm>
+#include <functional>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "inplace.hpp"
+#include "optimizer.hpp"
+#include "schedule.hpp"
+#include "timer.hpp"
+#include "utils.hpp"
+
+// `count` consecutive instances of `period` tasks with the same signatures, in positions of the origin schedule
+struct RepeatedRegion {
+    int begin = 0, period = 0, count = 0;
+
+    int end() const {
+        return begin + period * count;
+    }
+
+    bool contains(int position) const {
+        return begin <= position and position < end();
+    }
+
+    int instance(int position) const {
+        return (position - begin) / period;
+    }
+};
+
+// Solves re-computations of one instance of a repeated block and replicates them across the other instances
+class Replicator {
+    static constexpr int MIN_PERIOD = 2;
+    static constexpr int MAX_PERIOD = 512;
+    static constexpr int MIN_INSTANCES = 3;
+    static constexpr int DATAFLOW_WINDOW = 64;
+    static constexpr int REPRESENTATIVE_SEARCH_LIMIT = 300;
+
+    size_t limit;
+    bool inplace;
+    Optimizer::Progress progress;
+    SearchPolicy policy;
+
+    // Task names, operand sizes and (with `dataflow`) offsets to the producers of inputs, far producers are not
+    // distinguished so backward tasks reading forward activations also match
+    static std::vector<size_t> signatures(const Common &common, const std::vector<TaskHandle> &tasks, bool dataflow=true) {
+        std::hash<std::string> hasher;
+        std::map<OperandHandle, int> producer;
+        std::vector<size_t> result;
+        for (int i = 0; i < tasks.size(); ++ i) {
+            auto &task = tasks[i];
+            size_t hash = hasher(task->name) * 131ull + task->inplace;
+            for (auto &usage: task->ins) {
+                auto it = producer.find(usage.operand);
+                size_t offset = DATAFLOW_WINDOW + (common.already_on.count(usage.operand) ? 2 : 3);
+                if (it != producer.end()) {
+                    offset = std::min(i - it->second, DATAFLOW_WINDOW + 1);
+                }
+                hash = (hash * 131ull + usage.operand->size) * 131ull + (dataflow ? offset : 0);
+            }
+            for (auto &usage: task->outs) {
+                hash = hash * 131ull + usage.operand->size;
+                producer[usage.operand] = i;
+            }
+            result.push_back(hash);
+        }
+        return result;
+    }
+
+    // Maximal runs matching at every period, the widest non-overlapping ones are kept
+    static std::vector<RepeatedRegion> detect(const std::vector<size_t> &signatures) {
+        int size = signatures.size();
+        std::vector<RepeatedRegion> candidates;
+        for (int period = MIN_PERIOD; period <= std::min(MAX_PERIOD, size / MIN_INSTANCES); ++ period) {
+            for (int i = 0; i + period < size; ) {
+                int j = i;
+                while (j + period < size and signatures[j] == signatures[j + period]) {
+                    ++ j;
+                }
+                int count = (j - i + period) / period;
+                if (count >= MIN_INSTANCES) {
+                    candidates.push_back(RepeatedRegion {i, period, count});
+                }
+                i = std::max(j, i + 1);
+            }
+        }
+        std::sort(candidates.begin(), candidates.end(), [](const RepeatedRegion &a, const RepeatedRegion &b) {
+            int coverage_a = a.period * a.count, coverage_b = b.period * b.count;
+            return coverage_a != coverage_b ? coverage_a > coverage_b : a.period < b.period;
+        });
+        std::vector<RepeatedRegion> regions;
+        for (auto &candidate: candidates) {
+            bool overlapped = false;
+            for (auto &region: regions) {
+                overlapped = overlapped or (candidate.begin < region.end() and region.begin < candidate.end());
+            }
+            if (not overlapped) {
+                regions.push_back(candidate);
+            }
+        }
+        return regions;
+    }
+
+public:
+    Replicator(size_t limit, bool inplace=false, const Optimizer::Progress &progress=nullptr, const SearchPolicy &policy=SearchPolicy()):
+        limit(limit), inplace(inplace), progress(progress), policy(policy) {}
+
+    Optimizer::Result optimize(const ScheduleHandle &origin, bool verbose=true) const {
+        Timer timer;
+        origin->common->limit = limit;
+        origin->analyze();
+        auto &common = *origin->common;
+        std::vector<TaskHandle> tasks;
+        std::map<int, int> position;
+        std::map<OperandHandle, std::vector<int>> consumers;
+        LOOP(task, origin->head) {
+            position[task->id] = tasks.size();
+            for (auto &usage: task->ins) {
+                consumers[usage.operand].push_back(tasks.size());
+            }
+            tasks.push_back(task);
+        }
+        auto signature = signatures(common, tasks), kind = signatures(common, tasks, false);
+        auto regions = detect(signature);
+
+        // The middle instance of the widest region is the representative, away from the boundaries where dataflow differs
+        if (regions.empty()) {
+            if (verbose) {
+                printf(" > No repeated block found, searching the whole schedule\n");
+            }
+            return Optimizer(limit, inplace).search(origin, verbose);
+        }
+        auto &region = regions.front();
+        int instance = region.count / 2;
+        if (verbose) {
+            printf(" > Found %zu repeated regions, representative: instance %d of [%d, %d) (%d x %d tasks)\n", regions.size(),
+                   instance, region.begin, region.end(), region.count, region.period);
+        }
+
+        // Translate a re-computation into another instance along the dataflow: `gen` by the period, `use` as the
+        // consumer of the same output with the same name and sizes (and the same rank among them)
+        auto translate = [&](const Occupy &occupy, int target, Decision &translated) {
+            int gen = position[occupy.gen->id], use = position[occupy.use->id];
+            int shifted = gen + (target - instance) * region.period;
+            auto &origin_gen = tasks[gen], &new_gen = tasks[shifted];
+            for (int k = 0; k < origin_gen->outs.size(); ++ k) {
+                auto &origin_consumers = consumers[origin_gen->outs[k].operand];
+                auto it = std::find(origin_consumers.begin(), origin_consumers.end(), use);
+                if (it == origin_consumers.end()) {
+                    continue;
+                }
+                int rank = std::count_if(origin_consumers.begin(), it, [&](int c) { return kind[c] == kind[use]; });
+                for (int c: consumers[new_gen->outs[k].operand]) {
+                    if (kind[c] == kind[use] and rank -- == 0) {
+                        translated = Decision {new_gen->id, tasks[c]->id, false, occupy.gen->recomputed, occupy.use->recomputed};
+                        return true;
+                    }
+                }
+                return false;
+            }
+            return false;
+        };
+
+        // Search re-computations generated from the representative, every substitution applies one to all instances
+        // (resolved on the same analysis), so the search space shrinks by the number of instances
+        for (int p = region.begin + instance * region.period; p < region.begin + (instance + 1) * region.period; ++ p) {
+            common.focus.insert(tasks[p]->id);
+        }
+        ScheduleHandle indexed;
+        std::map<std::pair<int, bool>, std::vector<TaskHandle>> index;
+        int replicated = 0, skipped = 0;
+        auto replicate = [&](const ScheduleHandle &schedule, const Occupy &occupy) -> ScheduleHandle {
+            if (indexed != schedule) {
+                indexed = schedule;
+                index.clear();
+                LOOP(task, schedule->head) {
+                    index[std::make_pair(task->id, task->recomputed)].push_back(task);
+                }
+            }
+            auto find = [&](int id, bool recomputed, int after) -> TaskHandle {
+                auto it = index.find(std::make_pair(id, recomputed));
+                if (it != index.end()) {
+                    for (auto &task: it->second) {
+                        if (task->time_stamp > after) {
+                            return task;
+                        }
+                    }
+                }
+                return nullptr;
+            };
+            std::vector<Occupy> occupies = {occupy};
+            for (int target = 0; target < region.count; ++ target) {
+                Decision translated;
+                if (target == instance or not translate(occupy, target, translated)) {
+                    skipped += target != instance;
+                    continue;
+                }
+                auto gen = find(translated.gen, translated.gen_recomputed, 0);
+                auto use = gen ? find(translated.use, translated.use_recomputed, gen->time_stamp) : nullptr;
+                auto new_occupy = Occupy {gen, use};
+                if (not use or not new_occupy.resolve()) {
+                    ++ skipped;
+                    continue;
+                }
+                new_occupy.calculate(schedule->profile.peak.time_stamp, schedule->peak_memory, schedule->total_time, common.time_z);
+                occupies.push_back(new_occupy);
+            }
+            auto new_schedule = schedule->apply(occupies);
+            if (not InplaceRewrite::safe(new_schedule)) {
+                return schedule->apply(occupy);
+            }
+            replicated += occupies.size() - 1;
+            return new_schedule;
+        };
+        auto solved = Optimizer(limit, inplace, REPRESENTATIVE_SEARCH_LIMIT, nullptr, replicate, nullptr, policy).search(origin->copy(), false);
+        common.focus.clear();
+        if (verbose) {
+            printf(" > Searched the representative in %d schedules: %s (%d re-computations replicated, %d skipped)\n",
+                   solved.count, solved.best->info().c_str(), replicated, skipped);
+        }
+
+        // Polish the whole schedule until the limit is satisfied or the caller stops it, compared against the origin
+        auto result = solved;
+        if (not solved.satisfied) {
+            auto satisfied = [this](int count, const ScheduleHandle &best) {
+                return best->peak_memory > limit and (not progress or progress(count, best));
+            };
+            result = Optimizer(limit, inplace, Optimizer::SEARCH_LIMIT, satisfied, nullptr, nullptr, policy)
+                .search(solved.best, verbose, origin->analyze().second);
+            result.count += solved.count;
+        }
+        result.origin = origin;
+        result.used_time = timer.tik();
+        result.satisfied = result.best->peak_memory <= limit;
+        return result;
+    }
+};
+
+constexpr int Replicator::MAX_PERIOD;
@@ -1,26 +1,343 @@
 #pragma once
 
+#include <cstdio>
 #include <iostream>
 #include <string>
 #include <utility>
+#include <vector>
 
+#include "calibration.hpp"
+#include "checkpoint.hpp"
+#include "coarsen.hpp"
+#include "fusion.hpp"
+#include "multiprocess.hpp"
 #include "optimizer.hpp"
+#include "partition.hpp"
+#include "replicate.hpp"
 #include "schedule.hpp"
+#include "split.hpp"
+#include "stream.hpp"
 #include "utils.hpp"
+#include "validator.hpp"
+
+struct Options {
+    // Percentile of total time to optimize, 50 for the mean
+    double percentile = 50;
+
+    // Correction factors fitted from the profile of an optimized run
+    std::string calibration;
+
+    // Fusion analysis: "none", "report" (print suggestions) or "simulate" (also search on the fused schedule)
+    std::string fusion = "none";
+
+    // Rewrite element-wise tasks into in-place variants while searching
+    bool inplace = false;
+
+    // Count of segments optimized independently, 1 for the whole schedule
+    int partition = 1;
+
+    // Maximum count of tasks merged into a super-task for the coarse search, 1 for no coarsening
+    int coarsen = 1;
+
+    // Tasks per window in the streaming mode, 0 for loading the whole trace
+    int stream = 0;
+
+    // Forked search workers sharing the frontier, 1 for searching in this process
+    int processes = 1;
+
+    // Split tasks around the peak over the batch dimension, with the default or a given cost model
+    bool split = false;
+    std::string split_model;
+
+    // Gradient buckets and interconnect of data-parallel training, whose all-reduces delay frees and stall readers
+    std::string data_parallel;
+
+    // Solve one instance of repeated blocks and replicate its re-computations
+    bool replicate = false;
+
+    // Validate the dataflow of the written output against the input
+    bool validate = false;
+
+    // Strategy, objective and cost model of the search
+    SearchPolicy policy;
+
+    // Periodic snapshots of the search, and continuing from the last one
+    std::string checkpoint;
+    uint64_t checkpoint_interval = Checkpointer::DEFAULT_INTERVAL;
+    bool resume = false;
+
+    // Set by embedding programs, not by command-line arguments
+    bool verbose = true;
+    Optimizer::Progress progress;
+
+    static Options fromArguments(const std::vector<std::string> &arguments) {
+        Options options;
+        for (auto &argument: arguments) {
+            auto pos = argument.find('=');
+            auto key = argument.substr(0, pos);
+            auto value = pos == std::string::npos ? "" : argument.substr(pos + 1);
+            if (key == "--percentile") {
+                options.percentile = std::stod(value);
+                if (options.percentile < 50 or options.percentile >= 100) {
+                    error("Percentile should be in [50, 100)\n");
+                }
+            } else if (key == "--calibration") {
+                options.calibration = value;
+            } else if (key == "--split") {
+                options.split = true;
+                options.split_model = value;
+            } else if (key == "--data-parallel") {
+                options.data_parallel = value;
+            } else if (key == "--replicate") {
+                options.replicate = true;
+            } else if (key == "--validate") {
+                options.validate = true;
+            } else if (key == "--strategy") {
+                options.policy.strategy = value;
+                if (value != "best-first" and value != "beam" and value != "greedy") {
+                    error("Search strategy should be best-first, beam or greedy\n");
+                }
+            } else if (key == "--objective") {
+                options.policy.objective = value;
+                if (value != "balanced" and value != "memory") {
+                    error("Objective should be balanced or memory\n");
+                }
+            } else if (key == "--cost") {
+                options.policy.cost = value;
+                if (value != "balanced" and value != "memory") {
+                    error("Cost model should be balanced or memory\n");
+                }
+            } else if (key == "--checkpoint") {
+                options.checkpoint = value;
+            } else if (key == "--checkpoint-interval") {
+                options.checkpoint_interval = static_cast<uint64_t>(std::stod(value) * Unit::s(1));
+                if (options.checkpoint_interval == 0) {
+                    error("Checkpoint interval should be positive\n");
+                }
+            } else if (key == "--resume") {
+                options.resume = true;
+            } else if (key == "--inplace") {
+                options.inplace = true;
+            } else if (key == "--partition") {
+                options.partition = std::stoi(value);
+                if (options.partition < 1) {
+                    error("Partition count should be positive\n");
+                }
+            } else if (key == "--coarsen") {
+                options.coarsen = std::stoi(value);
+                if (options.coarsen < 1) {
+                    error("Coarsening block size should be positive\n");
+                }
+            } else if (key == "--stream") {
+                options.stream = std::stoi(value);
+                if (options.stream < 1) {
+                    error("Window size should be positive\n");
+                }
+            } else if (key == "--processes") {
+                options.processes = std::stoi(value);
+                if (options.processes < 1) {
+                    error("Process count should be positive\n");
+                }
+            } else if (key == "--fusion") {
+                options.fusion = value;
+                if (value != "none" and value != "report" and value != "simulate") {
+                    error("Fusion mode should be none, report or simulate\n");
+                }
+            } else {
+                error("Unknown option %s\n", argument.c_str());
+            }
+        }
+        if (options.resume and options.checkpoint.empty()) {
+            error("Resuming requires a checkpoint path\n");
+        }
+        return options;
+    }
+};
 
 class Runner {
+    static constexpr int REFINE_SEARCH_LIMIT = 300;
+
     std::string input, output;
     size_t limit;
+    Options options;
 
 public:
-    Runner(const std::string &input, const std::string &output, size_t limit): input(input), output(output), limit(limit) {}
+    Runner(const std::string &input, const std::string &output, size_t limit, const Options &options=Options()):
+        input(input), output(output), limit(limit), options(options) {}
 
     void run() {
+        if (options.stream > 0) {
+            // Windows are optimized on their own while reading, only in-place rewriting applies to them
+            std::string ignored;
+            auto ignore = [&ignored](bool set, const char *option) {
+                if (set) {
+                    ignored += (ignored.empty() ? "" : ", ") + std::string(option);
+                }
+            };
+            ignore(options.percentile != 50, "--percentile");
+            ignore(not options.calibration.empty(), "--calibration");
+            ignore(options.fusion != "none", "--fusion");
+            ignore(options.partition > 1, "--partition");
+            ignore(options.coarsen > 1, "--coarsen");
+            ignore(options.processes > 1, "--processes");
+            ignore(options.split, "--split");
+            ignore(not options.data_parallel.empty(), "--data-parallel");
+            ignore(options.replicate, "--replicate");
+            ignore(options.validate, "--validate");
+            ignore(not options.checkpoint.empty(), "--checkpoint");
+            ignore(not options.policy.isDefault(), "--strategy, --objective and --cost");
+            if (not ignored.empty()) {
+                warning("Streaming does not support %s, ignored\n", ignored.c_str());
+            }
+            Streamer(limit, options.stream, options.inplace).run(input, output);
+            return;
+        }
+
         ScheduleHandle schedule;
         int count;
         std::tie(schedule, count) = Schedule::fromFile(input);
-        auto optimizer = Optimizer(limit);
-        printf("Running case %s (%d operators) with %s ... \n", input.c_str(), count, optimizer.name().c_str());
-        optimizer.optimize(schedule, output);
+        auto name = Optimizer(limit, false, Optimizer::SEARCH_LIMIT, nullptr, nullptr, nullptr, options.policy).name();
+        printf("Running case %s (%d operators) with %s ... \n", input.c_str(), count, name.c_str());
+        Optimizer::report(optimize(schedule, limit, options), output);
+        if (options.validate) {
+            auto validation = Validator().validateFiles(input, output);
+            Validator::report(validation);
+            if (not validation.passed()) {
+                error("Validation of %s failed\n", output.c_str());
+            }
+        }
+    }
+
+    // Everything after loading, shared with the embedded library
+    static Optimizer::Result optimize(ScheduleHandle schedule, size_t limit, const Options &options) {
+        bool verbose = options.verbose;
+        schedule->common->time_z = normalQuantile(options.percentile / 100);
+        schedule->common->limit = limit;
+        int calibrated = 0;
+        if (not options.calibration.empty()) {
+            calibrated = Calibration::fromFile(options.calibration).apply(schedule);
+        }
+        if (verbose and options.percentile != 50) {
+            printf(" > Optimizing P%g of total time\n", options.percentile);
+        }
+        if (verbose and not options.calibration.empty()) {
+            printf(" > Calibrated %d operators with %s\n", calibrated, options.calibration.c_str());
+        }
+        schedule->common->split = nullptr;
+        if (options.split and options.processes > 1) {
+            warning("Splitting is not supported by multi-process search, ignored\n");
+        } else if (options.split) {
+            auto model = options.split_model.empty() ? SplitModel::defaults() : SplitModel::fromFile(options.split_model);
+            model.prepare(schedule);
+            schedule->common->split = std::make_shared<SplitModel>(model);
+        }
+        schedule->common->parallel = nullptr;
+        if (not options.data_parallel.empty() and options.partition > 1) {
+            warning("Data-parallel communication is not supported by partitioning, ignored\n");
+        } else if (not options.data_parallel.empty()) {
+            auto &common = *schedule->common;
+            auto model = DataParallel::fromFile(options.data_parallel, common.operands, common.aliases, schedule->head);
+            uint64_t single = common.analyzeTime(schedule->head);
+            common.parallel = std::make_shared<DataParallel>(model);
+            schedule->analyzed = false;
+            if (verbose) {
+                size_t size = 0;
+                for (auto &item: model.bucket_of) {
+                    size += common.operands[item.first]->size;
+                }
+                printf(" > Data parallel over %d workers: %zu buckets (%s), communication adds %s\n", model.workers,
+                       model.buckets.size(), prettyBytes(size).c_str(),
+                       prettyNanoseconds(common.analyzeTime(schedule->head) - single).c_str());
+            }
+        }
+        bool fused = false;
+        if (options.fusion != "none") {
+            auto suggestions = Fusion::analyze(schedule);
+            if (verbose) {
+                Fusion::report(suggestions);
+            }
+            if (options.fusion == "simulate" and not suggestions.empty()) {
+                if (verbose) {
+                    printf(" > Before fusion: {%s}\n", schedule->info().c_str());
+                }
+                schedule = Fusion::apply(schedule, suggestions);
+                fused = true;
+                if (verbose) {
+                    printf(" > After simulated fusion: {%s}\n", schedule->info().c_str());
+                }
+            }
+        }
+
+        // Coarse search on super-tasks
+        auto searched = schedule;
+        if (options.coarsen > 1) {
+            searched = Coarsener(options.coarsen).coarsen(schedule);
+            if (verbose) {
+                printf(" > Coarsened into %d super-tasks (block size %d)\n", Coarsener::count(searched), options.coarsen);
+            }
+        }
+
+        // Checkpoints of the single search, a fresh search overwrites the last one
+        std::shared_ptr<Checkpointer> checkpointer;
+        if (not options.checkpoint.empty()) {
+            if (options.inplace or options.partition > 1 or options.processes > 1 or options.replicate or options.coarsen > 1) {
+                warning("Checkpoints are only supported by the plain search, ignored\n");
+            } else {
+                if (not options.resume) {
+                    std::remove(options.checkpoint.c_str());
+                }
+                checkpointer = std::make_shared<Checkpointer>(options.checkpoint, options.checkpoint_interval);
+            }
+        }
+
+        if (not options.policy.isDefault() and (options.partition > 1 or options.processes > 1)) {
+            warning("Search policies are only supported by the plain search, ignored\n");
+        }
+
+        Optimizer::Result result;
+        if (options.partition > 1) {
+            result = Partitioner(limit, options.partition, options.inplace).optimize(searched);
+        } else if (options.processes > 1) {
+            if (options.inplace) {
+                warning("In-place rewriting is not supported by multi-process search, ignored\n");
+            }
+            result = ProcessSearch(limit, options.processes, Optimizer::SEARCH_LIMIT).search(searched);
+        } else if (options.replicate) {
+            result = Replicator(limit, options.inplace, options.progress, options.policy).optimize(searched, verbose);
+        } else {
+            result = Optimizer(limit, options.inplace, Optimizer::SEARCH_LIMIT, options.progress, nullptr, checkpointer,
+                               options.policy).search(searched, verbose);
+        }
+
+        // Refine inside the chosen blocks
+        if (options.coarsen > 1) {
+            auto refined = Coarsener::refine(result.best);
+            if (verbose) {
+                printf(" > Refining from the coarse best (%s)\n", refined->info().c_str());
+            }
+            auto refined_result = Optimizer(limit, options.inplace, REFINE_SEARCH_LIMIT, options.progress, nullptr, nullptr,
+                                            options.policy).search(refined, verbose, schedule->analyze().second);
+            refined_result.origin = schedule;
+            refined_result.count += result.count;
+            refined_result.used_time += result.used_time;
+            result = refined_result;
+        }
+
+        // Simulated fusions are written as their origin tasks, the result is the written program
+        if (fused) {
+            auto written = result.best->copy();
+            Common::expand(written->head);
+            written->analyze();
+            if (verbose) {
+                printf(" > Best with simulated fusion: {%s}, written unfused: {%s}\n", result.best->info().c_str(),
+                       written->info().c_str());
+            }
+            result.best = written;
+            result.satisfied = written->peak_memory <= limit;
+            if (not result.satisfied) {
+                warning("The written program without fusion peaks at %s, above the limit\n", prettyBytes(written->peak_memory).c_str());
+            }
+        }
+        return result;
     }
 };
@@ -0,0 +1,142 @@
+#pragma once
+
+#include <algorithm>
+#include <map>
+#include <set>
+#include <vector>
+
+#include "schedule.hpp"
+#include "utils.hpp"
+
+// Operands scaling with the batch, inferred from their shapes: activations scale, while pinned operands (weights in
+// `already_on`/`not_dealloc`) do not unless they are inputs or outputs with the batch as the leading dimension
+struct BatchScaling {
+    int base = 0;
+    std::vector<bool> scaled;
+    std::vector<size_t> sizes;
+
+    static int leading(const OperandHandle &operand) {
+        auto &attr = operand->attr;
+        if (attr.is_object() and attr.count("shape") and attr["shape"].is_array() and not attr["shape"].empty()) {
+            return attr["shape"][0];
+        }
+        return 0;
+    }
+
+    // The most common leading dimension of generated operands, 0 without shapes
+    static int inferBase(const Common &common) {
+        std::map<int, int> counts;
+        for (auto &operand: common.operands) {
+            if (operand and not common.already_on.count(operand) and leading(operand) > 0) {
+                ++ counts[leading(operand)];
+            }
+        }
+        if (counts.empty()) {
+            return 0;
+        }
+        return std::max_element(counts.begin(), counts.end(), [](const std::pair<const int, int> &a, const std::pair<const int, int> &b) {
+            return a.second < b.second;
+        })->first;
+    }
+
+    // With `base` unset, it is inferred from shapes
+    static BatchScaling infer(const ScheduleHandle &schedule, int base=0) {
+        auto &common = *schedule->common;
+        BatchScaling scaling;
+        if (base == 0) {
+            base = inferBase(common);
+            if (base == 0) {
+                error("No shapes to infer the batch size from, set --base-batch\n");
+            }
+        }
+        scaling.base = base;
+        std::set<int> visible;
+        for (auto &ids: {common.inputs, common.outputs}) {
+            for (auto &id: ids) {
+                visible.insert(id.get<int>());
+            }
+        }
+        for (auto &operand: common.operands) {
+            if (not operand) {
+                scaling.scaled.push_back(false);
+                scaling.sizes.push_back(0);
+                continue;
+            }
+            int dimension = leading(operand);
+            bool pinned = common.already_on.count(operand) or common.not_dealloc.count(operand);
+            bool batched = dimension == base or (dimension == 0 and not pinned);
+            scaling.scaled.push_back(batched and (not pinned or visible.count(operand->id)));
+            scaling.sizes.push_back(operand->size);
+        }
+        return scaling;
+    }
+
+    int count() const {
+        return std::count(scaled.begin(), scaled.end(), true);
+    }
+
+    // Sizes (and shapes) of the shared operands are set in place, so schedules at different batches can not coexist
+    void resize(const Common &common, int batch) const {
+        for (int id = 0; id < common.operands.size(); ++ id) {
+            auto &operand = common.operands[id];
+            if (operand and scaled[id]) {
+                operand->size = (sizes[id] * batch + base - 1) / base;
+                if (leading(operand) > 0) {
+                    operand->attr["shape"][0] = batch;
+                }
+            }
+        }
+    }
+
+    // A copy at `batch`, tasks touching scaled operands take time and workspace proportionally
+    ScheduleHandle apply(const ScheduleHandle &schedule, int batch) const {
+        resize(*schedule->common, batch);
+        auto scaled_schedule = schedule->copy();
+        double ratio = static_cast<double>(batch) / base;
+        LOOP(task, scaled_schedule->head) {
+            bool touched = false;
+            for (auto *usages: {&task->ins, &task->outs}) {
+                for (auto &usage: *usages) {
+                    touched = touched or scaled[usage.operand->id];
+                }
+            }
+            if (touched) {
+                task->duration = static_cast<uint64_t>(task->duration * ratio);
+                task->recompute_duration = static_cast<uint64_t>(task->recompute_duration * ratio);
+                task->variance *= ratio * ratio;
+                task->workspace = static_cast<size_t>(task->workspace * ratio);
+                task->recompute_workspace = static_cast<size_t>(task->recompute_workspace * ratio);
+            }
+        }
+        return scaled_schedule;
+    }
+
+    // No plan goes below the pinned operands plus the largest working set of a single task
+    size_t lowerBound(const ScheduleHandle &schedule, int batch) const {
+        auto &common = *schedule->common;
+        auto size = [this, batch](const OperandHandle &operand) {
+            return scaled[operand->id] ? (sizes[operand->id] * batch + base - 1) / base : sizes[operand->id];
+        };
+        size_t resident = 0, working = 0;
+        for (auto &operand: common.already_on) {
+            resident += common.not_dealloc.count(operand) ? size(operand) : 0;
+        }
+        double ratio = static_cast<double>(batch) / base;
+        LOOP(task, schedule->head) {
+            size_t current = 0;
+            bool touched = false;
+            for (auto *usages: {&task->ins, &task->outs}) {
+                for (auto &usage: *usages) {
+                    auto &operand = usage.operand;
+                    touched = touched or scaled[operand->id];
+                    if (not (common.already_on.count(operand) and common.not_dealloc.count(operand))) {
+                        current += size(operand);
+                    }
+                }
+            }
+            current += touched ? static_cast<size_t>(task->workspace * ratio) : task->workspace;
+            working = std::max(working, current);
+        }
+        return resident + working;
+    }
+};
@@ -1,6 +1,7 @@
 #pragma once
 
 #include <cassert>
+#include <cmath>
 #include <map>
 #include <memory>
 #include <set>
@@ -9,6 +10,7 @@
 #include <fstream>
 
 #include "json.hpp"
+#include "reader.hpp"
 #include "utils.hpp"
 
 struct Operand;
@@ -23,6 +25,8 @@ typedef std::shared_ptr<Common> CommonHandle;
 struct Schedule;
 typedef std::shared_ptr<Schedule> ScheduleHandle;
 
+struct SplitModel;
+
 // All schedules share a common set of operands
 struct Operand {
     // Can be shared by other schedules
@@ -60,8 +64,23 @@ struct Task {
     size_t workspace = 0;
     std::vector<OperandUsage> ins, outs;
     uint64_t duration = 0;
+    double variance = 0;
     bool inplace = false;
 
+    // Cost when running as a re-computation (kernels run cold), equal to the origin unless calibrated
+    uint64_t recompute_duration = 0;
+    size_t recompute_workspace = 0;
+    bool recomputed = false;
+
+    // Origin tasks of a simulated fusion, expanded while restoring
+    std::vector<TaskHandle> fused;
+
+    // Sequential micro-tasks over the batch dimension, expanded while restoring
+    int split = 1;
+
+    // Inputs and outputs before in-place rewrites renamed them (restored as `.share`), owned by the schedule
+    TaskHandle origin_names;
+
     // Structure
     TaskHandle prev, next;
 
@@ -71,6 +90,9 @@ struct Task {
     std::vector<OperandHandle> to_dealloc_after;
     nlohmann::json attr;
 
+    // Gradient buckets whose all-reduce starts after this task or completes before its end, by `analyzeCommunication`
+    std::vector<int> ready_buckets, completed_buckets;
+
     TaskHandle copy() const {
         // Attr will be not copied for saving memory
         auto new_task = std::make_shared<Task>();
@@ -80,7 +102,30 @@ struct Task {
         new_task->outs = outs;
         new_task->id = id;
         new_task->duration = duration;
+        new_task->variance = variance;
         new_task->inplace = inplace;
+        new_task->recompute_duration = recompute_duration;
+        new_task->recompute_workspace = recompute_workspace;
+        new_task->recomputed = recomputed;
+        new_task->fused = fused;
+        new_task->split = split;
+        new_task->origin_names = origin_names;
+        return new_task;
+    }
+
+    double recomputeRatio() const {
+        return duration ? static_cast<double>(recompute_duration) / duration : 1.0;
+    }
+
+    TaskHandle recompute() const {
+        auto new_task = copy();
+        new_task->duration = recompute_duration;
+        new_task->variance = variance * recomputeRatio() * recomputeRatio();
+        new_task->workspace = recompute_workspace;
+        new_task->recomputed = true;
+        for (auto &fused: new_task->fused) {
+            fused = fused->recompute();
+        }
         return new_task;
     }
 
@@ -132,6 +177,8 @@ struct Task {
             usage.next_gen = usage.gen = usage.last_use = nullptr;
         }
         to_dealloc_after.clear();
+        ready_buckets.clear();
+        completed_buckets.clear();
     }
 
     bool contains(const OperandHandle &operand, bool is_out=true) const {
@@ -156,6 +203,25 @@ struct Task {
         return outs[0];
     }
 
+    uint64_t robustDuration(double z, bool recomputed=false) const {
+        // Duration at the `z` standard deviations, jittery tasks are more expensive to re-compute
+        double ratio = recomputed ? recomputeRatio() : 1.0;
+        uint64_t mean = recomputed ? recompute_duration : duration;
+        return mean + static_cast<uint64_t>(std::max(z, 0.0) * std::sqrt(variance) * ratio);
+    }
+
+    bool isElementwise() const {
+        static const std::set<std::string> names = {
+            "bn", "batchnorm", "batch_norm", "relu", "relu6", "sigmoid", "tanh", "gelu", "dropout",
+            "add", "sub", "mul", "div", "scale", "bias_add", "elementwise"
+        };
+        return names.count(name) > 0;
+    }
+
+    bool isBlock() const {
+        return name.compare(0, 7, ".block(") == 0;
+    }
+
     bool isDealloc() const {
         return name == ".dealloc";
     }
@@ -170,7 +236,7 @@ struct Task {
 
     static TaskHandle fromJson(int id, const std::vector<OperandHandle> &operands, const nlohmann::json &json) {
         auto task = std::make_shared<Task>();
-        auto fill = [operands](std::vector<OperandUsage> &vec, const nlohmann::json &array) {
+        auto fill = [&operands](std::vector<OperandUsage> &vec, const nlohmann::json &array) {
             vec.resize(array.size());
             // Python processor has already assumed `arch == "CUDA"`
             for (int i = 0; i < vec.size(); ++ i) {
@@ -185,33 +251,55 @@ struct Task {
         fill(task->outs, json["outs"]);
         task->workspace = json["workspace"];
         task->duration = Unit::us(static_cast<double>(json["time"]));
+        // Variance is in us^2, the processor of older versions may not provide it
+        if (json.count("time_var")) {
+            task->variance = static_cast<double>(json["time_var"]) * Unit::us(1) * Unit::us(1);
+        }
         task->attr = json["attr"];
+        task->recompute_duration = task->duration;
+        task->recompute_workspace = task->workspace;
+        task->detectInplace();
+
+        assert(not task->isForbidden());
+        return task;
+    }
 
-        // Detect inplace
-        std::set<OperandHandle> ins;
-        for (auto &usage: task->ins) {
-            ins.insert(usage.operand);
+    void detectInplace() {
+        std::set<OperandHandle> in_operands;
+        for (auto &usage: ins) {
+            in_operands.insert(usage.operand);
         }
-        task->inplace = false;
-        for (auto &usage: task->outs) {
-            if (ins.count(usage.operand)) {
-                task->inplace = true;
+        inplace = false;
+        for (auto &usage: outs) {
+            if (in_operands.count(usage.operand)) {
+                inplace = true;
                 break;
             }
         }
-
-        assert(not task->isForbidden());
-        return task;
     }
 };
 
-struct Occupy {
-    // It's different with comparator
+// Cost models score re-computations for the two prunings of `analyzeOccupies` (it's different with comparator)
+struct BalancedCost {
     static constexpr double O1_MEMORY_FACTOR = 0.2;
-    static constexpr double O1_TIME_FACTOR = 1.0 - O1_MEMORY_FACTOR;
     static constexpr double O2_MEMORY_FACTOR = 0.8;
-    static constexpr double O2_TIME_FACTOR = 1.0 - O2_MEMORY_FACTOR;
 
+    static std::string name() {
+        return "balanced";
+    }
+};
+
+// Prefers re-computations freeing memory at the peak even if they take longer
+struct MemoryCost {
+    static constexpr double O1_MEMORY_FACTOR = 0.5;
+    static constexpr double O2_MEMORY_FACTOR = 0.95;
+
+    static std::string name() {
+        return "memory";
+    }
+};
+
+struct Occupy {
     TaskHandle gen, use;
     std::vector<TaskHandle> re_gen;
     std::set<OperandUsage> re_gen_ins;
@@ -219,7 +307,8 @@ struct Occupy {
     bool move;
     double score1, score2;
 
-    void calculate(int peak_time_stamp, size_t peak_memory, uint64_t origin_time) {
+    template <typename Cost=BalancedCost>
+    void calculate(int peak_time_stamp, size_t peak_memory, uint64_t origin_time, double time_z) {
         // Maybe dead code
         move = true;
         for (auto &usage: gen->outs) {
@@ -230,9 +319,9 @@ struct Occupy {
         }
 
         // Time increased
-        uint64_t time_increased = move ? 0 : gen->duration;
+        uint64_t time_increased = move ? 0 : gen->robustDuration(time_z, true);
         for (auto &task: re_gen) {
-            time_increased += task->duration;
+            time_increased += task->robustDuration(time_z, true);
         }
 
         // Memory increased
@@ -252,10 +341,49 @@ struct Occupy {
         }
 
         // Calculate score, lower is better
-        score1 = static_cast<double>(memory_increased) / peak_memory * O1_MEMORY_FACTOR;
-        score1 += static_cast<double>(time_increased) / origin_time * O1_TIME_FACTOR;
-        score2 = static_cast<double>(memory_increased) / peak_memory * O2_MEMORY_FACTOR;
-        score2 += static_cast<double>(time_increased) / origin_time * O2_TIME_FACTOR;
+        score1 = static_cast<double>(memory_increased) / peak_memory * Cost::O1_MEMORY_FACTOR;
+        score1 += static_cast<double>(time_increased) / origin_time * (1.0 - Cost::O1_MEMORY_FACTOR);
+        score2 = static_cast<double>(memory_increased) / peak_memory * Cost::O2_MEMORY_FACTOR;
+        score2 += static_cast<double>(time_increased) / origin_time * (1.0 - Cost::O2_MEMORY_FACTOR);
+    }
+
+    // Collect tasks to re-generate with `gen`, so that its inputs keep their versions (run on an analyzed schedule)
+    bool resolve() {
+        re_gen_ins.insert(gen->ins.begin(), gen->ins.end());
+
+        // We're going to put `gen` before `use`, so we must ensure the inputs of `gen` will not change
+        static constexpr int RE_GEN_TASK_LIMIT = 3;
+        for (int i = -1; i < RE_GEN_TASK_LIMIT; ++ i) {
+            bool found = false;
+            OperandUsage bad_usage;
+            for (auto &usage: re_gen_ins) {
+                auto last_gen_before_re_gen = usage.next_gen;
+                while (last_gen_before_re_gen) {
+                    auto &re_gen_usage = last_gen_before_re_gen->find(usage.operand);
+                    if (re_gen_usage.next_gen and re_gen_usage.next_gen->time_stamp < use->time_stamp) {
+                        last_gen_before_re_gen = re_gen_usage.next_gen;
+                    } else {
+                        break;
+                    }
+                }
+                if (last_gen_before_re_gen and last_gen_before_re_gen->time_stamp < use->time_stamp) {
+                    auto &re_gen_usage = last_gen_before_re_gen->find(usage.operand);
+                    if (re_gen_usage.version != usage.version) {
+                        found = true;
+                        bad_usage = usage;
+                        break;
+                    }
+                }
+            }
+            if (found) {
+                re_gen.push_back(bad_usage.gen);
+                re_gen_ins.erase(bad_usage);
+                re_gen_ins.insert(bad_usage.gen->ins.begin(), bad_usage.gen->ins.end());
+            } else {
+                return true;
+            }
+        }
+        return false;
     }
 
     bool operator < (const Occupy &another) const {
@@ -264,6 +392,166 @@ struct Occupy {
     }
 };
 
+// Local maxima of execution memory and contiguous regions above the limit, found by `Common::analyzeMemory`
+struct MemoryProfile {
+    static constexpr int TOP_PEAKS = 5;
+    static constexpr int DOMINATING_OPERANDS = 3;
+
+    struct Peak {
+        int time_stamp = 0;
+        size_t memory = 0;
+    };
+
+    struct Region {
+        // Time stamps in [begin, end]
+        int begin = 0, end = 0;
+        Peak peak;
+        // Largest live operands at the peak of the region
+        std::vector<OperandHandle> dominating;
+    };
+
+    Peak peak;
+    std::vector<Peak> peaks;
+    std::vector<Region> regions;
+
+    // Operands live at the peak, largest first, only when asked for
+    std::vector<OperandHandle> live;
+
+    void addPeak(const Peak &local) {
+        auto it = peaks.begin();
+        while (it != peaks.end() and it->memory >= local.memory) {
+            ++ it;
+        }
+        if (it - peaks.begin() < TOP_PEAKS) {
+            peaks.insert(it, local);
+            if (peaks.size() > TOP_PEAKS) {
+                peaks.pop_back();
+            }
+        }
+    }
+};
+
+// Union-find over operand ids, views join the set of their storage root (the root stays the representative)
+struct AliasSets {
+    std::vector<int> parent;
+
+    explicit AliasSets(int count=0): parent(count) {
+        for (int i = 0; i < count; ++ i) {
+            parent[i] = i;
+        }
+    }
+
+    int find(int id) {
+        while (parent[id] != id) {
+            id = parent[id] = parent[parent[id]];
+        }
+        return id;
+    }
+
+    void alias(int view, int source) {
+        parent[find(view)] = find(source);
+    }
+
+    bool isView(int id) {
+        return find(id) != id;
+    }
+};
+
+// Data-parallel training: gradients are all-reduced in buckets on a communication stream overlapping the tasks, a
+// bucket starts once all its gradients are generated and they are not freed before it completes
+struct DataParallel {
+    int workers = 2;
+
+    // Interconnect bandwidth in GB/s (bytes per nanosecond) and fixed cost of every all-reduce in nanoseconds
+    double bandwidth = 25;
+    uint64_t latency = 10000;
+
+    // A flat copy of every bucket lives on device while it is communicated
+    bool buffer = false;
+
+    // Operand ids (storage roots) of every bucket, in the order they are communicated if ready together
+    std::vector<std::vector<int>> buckets;
+    std::map<int, int> bucket_of;
+
+    // Ring all-reduce sends and receives 2 (n - 1) / n of the bucket on every worker
+    uint64_t allReduce(size_t size) const {
+        double ratio = 2.0 * (workers - 1) / workers;
+        return latency + static_cast<uint64_t>(ratio * size / bandwidth);
+    }
+
+    int bucket(int id) const {
+        auto it = bucket_of.find(id);
+        return it == bucket_of.end() ? -1 : it->second;
+    }
+
+    // `{"workers": <n>, "bandwidth": <GB/s>, "latency": <ns>, "buffer": <bool>, "buckets": [[<id>, ...], ...]}`, or
+    // `"gradients": [<id>, ...]` with `"bucket_size"` to fill buckets in the order gradients are generated
+    static DataParallel fromFile(const std::string &path, const std::vector<OperandHandle> &operands,
+                                 AliasSets &aliases, const TaskHandle &head) {
+        std::ifstream file(path);
+        if (not file) {
+            error("Failed to open data-parallel config %s\n", path.c_str());
+        }
+        nlohmann::json json;
+        file >> json;
+        DataParallel model;
+        model.workers = json.value("workers", model.workers);
+        model.bandwidth = json.value("bandwidth", model.bandwidth);
+        model.latency = json.value("latency", model.latency);
+        model.buffer = json.value("buffer", model.buffer);
+        if (model.workers < 2 or model.bandwidth <= 0) {
+            error("Data-parallel config %s needs at least 2 workers and a positive bandwidth\n", path.c_str());
+        }
+        auto root = [&](int id) {
+            if (id < 0 or id >= operands.size() or not operands[id]) {
+                error("Unknown gradient %d in data-parallel config %s\n", id, path.c_str());
+            }
+            return aliases.find(id);
+        };
+        if (json.count("buckets")) {
+            for (auto &bucket: json["buckets"]) {
+                model.buckets.emplace_back();
+                for (int id: bucket) {
+                    model.buckets.back().push_back(root(id));
+                }
+            }
+        } else if (json.count("gradients")) {
+            std::set<int> gradients;
+            for (int id: json["gradients"]) {
+                gradients.insert(root(id));
+            }
+            size_t bucket_size = Unit::fromText(json.value("bucket_size", std::string("25MiB"))), filled = bucket_size;
+            LOOP(task, head) {
+                for (auto &usage: task->outs) {
+                    int id = aliases.find(usage.operand->id);
+                    if (gradients.erase(id)) {
+                        if (filled >= bucket_size) {
+                            model.buckets.emplace_back();
+                            filled = 0;
+                        }
+                        model.buckets.back().push_back(id);
+                        filled += operands[id]->size;
+                    }
+                }
+            }
+            if (not gradients.empty()) {
+                warning("%zu gradients are never generated, not communicated\n", gradients.size());
+            }
+        } else {
+            error("Data-parallel config %s has neither buckets nor gradients\n", path.c_str());
+        }
+        for (int i = 0; i < model.buckets.size(); ++ i) {
+            for (int id: model.buckets[i]) {
+                if (model.bucket_of.count(id)) {
+                    error("Gradient %d is in more than one bucket\n", id);
+                }
+                model.bucket_of[id] = i;
+            }
+        }
+        return model;
+    }
+};
+
 struct Common {
     std::vector<OperandHandle> operands;
     std::set<OperandHandle> already_on;
@@ -272,8 +560,32 @@ struct Common {
     std::map<int, nlohmann::json> attrs;
     nlohmann::json inputs, outputs, version;
 
+    // Views of the origin schedule, indexed by operand ids
+    AliasSets aliases;
+
+    // Total time is optimized at this quantile (standard score) of the normal approximation, 0 for the mean
+    double time_z = 0;
+
+    // Memory limit of the search, regions above it are profiled by `analyzeMemory` (0 for none)
+    size_t limit = 0;
+
+    // Ids of the tasks re-computations are generated from in `analyzeOccupies` (empty for all)
+    std::set<int> focus;
+
+    // Threads of every analysis pass, 0 to decide by the count of tasks
+    int threads = 0;
+
+    // Costs of splitting tasks over the batch dimension while searching (none for no splitting)
+    std::shared_ptr<SplitModel> split;
+
+    // Gradient all-reduces overlapping the tasks in data-parallel training (none for a single device)
+    std::shared_ptr<DataParallel> parallel;
+
+    static constexpr int PARALLEL_TASKS = 16384;
     static constexpr int O1_OCCUPIES_LIMIT = 2;
     static constexpr int O2_OCCUPIES_LIMIT = 2;
+    static constexpr double FILTER_GAP_RATIO = 0.05;
+    static constexpr double FILTER_PEAK_RATIO = 0.01;
     static constexpr int TIMES_PER_RANDOM = 1;
 
     static CommonHandle fromJson(nlohmann::json &json) {
@@ -294,7 +606,10 @@ struct Common {
         return common;
     }
 
-    bool check(TaskHandle &head) const {
+    // Failures exit if fatal, otherwise return false with a warning, or silently for checks of candidates
+    bool check(TaskHandle &head, bool fatal=true, bool verbose=true) const {
+        auto fail = fatal ? error : (verbose ? warning : silent);
+
         // Clear status
         for (auto &operand: operands) {
             operand->clear();
@@ -308,7 +623,7 @@ struct Common {
             if (task->isDealloc()) {
                 for (auto &usage: task->outs) {
                     if (not usage.operand->on_device) {
-                        error("Operand %d not on device (.dealloc)\n", usage.operand->id);
+                        fail("Operand %d not on device (.dealloc)\n", usage.operand->id);
                         return false;
                     }
                     usage.operand->on_device = false;
@@ -316,7 +631,7 @@ struct Common {
             } else {
                 for (auto &usage: task->ins) {
                     if (not usage.operand->on_device) {
-                        error("Operand %d not on device (normal operators)\n", usage.operand->id);
+                        fail("Operand %d not on device (normal operators)\n", usage.operand->id);
                         return false;
                     }
                 }
@@ -329,11 +644,11 @@ struct Common {
         // Check final status
         for (auto &operand: operands) {
             if (operand->on_device and not not_dealloc.count(operand)) {
-                error("Forget to dealloc %d\n", operand->id);
+                fail("Forget to dealloc %d\n", operand->id);
                 return false;
             }
             if (not operand->on_device and not_dealloc.count(operand)) {
-                error("Operand %d has been dealloc but should not\n", operand->id);
+                fail("Operand %d has been dealloc but should not\n", operand->id);
                 return false;
             }
         }
@@ -374,173 +689,465 @@ struct Common {
     }
 
     void analyzeShare(TaskHandle &head) {
-        std::map<OperandHandle, OperandHandle> real_usage;
+        // Shared views of any depth are renamed to their storage roots, so memory is accounted per root
+        aliases = AliasSets(operands.size());
         std::set<OperandHandle> generated;
+        auto root = [this](const OperandHandle &operand) {
+            return operands[aliases.find(operand->id)];
+        };
         LOOP(task, head) {
             if (task->isShare()) {
                 assert(task->ins.size() == 1);
-                auto source = task->ins[0].operand;
-                // Operand renaming
-                // All the shared operands will be rename to the first
-                if (real_usage.count(source)) {
-                    source = real_usage[source];
-                }
-                assert(not real_usage.count(source));
+                auto &source = task->ins[0].operand;
                 for (auto &usage: task->outs) {
                     assert(not generated.count(usage.operand));
                     generated.insert(usage.operand);
-                    real_usage[usage.operand] = source;
+                    aliases.alias(usage.operand->id, source->id);
                 }
             } else if (not task->isDealloc()) {
-                bool hasShared = false;
-                auto check = [&hasShared, real_usage](std::vector<OperandUsage> &usages) {
-                    for (auto &usage: usages) {
-                        if (real_usage.count(usage.operand)) {
-                            hasShared = true;
-                        }
+                bool has_shared = false;
+                for (auto *usages: {&task->ins, &task->outs}) {
+                    for (auto &usage: *usages) {
+                        has_shared = has_shared or aliases.isView(usage.operand->id);
                     }
-                };
-                check(task->ins);
-                check(task->outs);
+                }
                 // Backup and rename
-                if (hasShared) {
+                if (has_shared) {
                     auto backup = std::make_shared<Task>();
-                    auto gen = [&real_usage](std::vector<OperandUsage> &usages, std::vector<OperandUsage> &backup_usages) {
-                        for (auto &usage: usages) {
-                            auto real = real_usage.count(usage.operand) ? real_usage[usage.operand] : usage.operand;
-                            backup_usages.push_back(OperandUsage {usage.operand});
-                            usage.operand = real;
-                        }
-                    };
-                    gen(task->ins, backup->ins);
-                    gen(task->outs, backup->outs);
+                    for (auto &usage: task->ins) {
+                        backup->ins.push_back(OperandUsage {usage.operand});
+                        usage.operand = root(usage.operand);
+                    }
+                    for (auto &usage: task->outs) {
+                        backup->outs.push_back(OperandUsage {usage.operand});
+                        usage.operand = root(usage.operand);
+                    }
                     real_task[task->id] = backup;
                 }
             }
         }
     }
 
+    // Threads of one analysis pass over `count` tasks, every thread takes at least `PARALLEL_TASKS` of them
+    int analysisThreads(int count) const {
+        int automatic = std::min<int>(std::thread::hardware_concurrency(), count / PARALLEL_TASKS);
+        return std::max(threads > 0 ? threads : automatic, 1);
+    }
+
     void analyzeTopology(TaskHandle &head) const {
         // Clear status
         for (auto &operand: operands) {
             operand->clear();
         }
+        std::vector<TaskHandle> tasks;
         LOOP(task, head) {
+            assert(not task->isDealloc());
             task->clear();
+            tasks.push_back(task);
+        }
+        int count = tasks.size(), thread_count = analysisThreads(count), max_id = 0;
+        for (auto &operand: operands) {
+            max_id = std::max(max_id, operand->id);
         }
 
-        // Analyze generating task and previous use
-        std::map<OperandHandle, TaskHandle> prev_use;
-        std::map<OperandHandle, TaskHandle> gen;
-        LOOP(task, head) {
-            assert(not task->isDealloc());
+        // Def-use chains of different operands are independent, every thread links the usages of operands with ids in
+        // its residue class, in the same order as a single pass. Positions of the generating task and previous use
+        // are kept per operand
+        parallelFor(thread_count, [&](int thread) {
+            auto mine = [thread_count, thread](const OperandUsage &usage) {
+                return usage.operand->id % thread_count == thread;
+            };
+            auto slot = [thread_count](const OperandUsage &usage) {
+                return usage.operand->id / thread_count;
+            };
+            std::vector<int> gen(max_id / thread_count + 1, -1), prev_use(gen);
+            for (int i = 0; i < count; ++ i) {
+                auto &task = tasks[i];
+                for (auto &usage: task->ins) {
+                    if (not mine(usage)) {
+                        continue;
+                    }
+                    int &last_gen = gen[slot(usage)], &last_use = prev_use[slot(usage)];
+                    usage.gen = last_gen >= 0 ? tasks[last_gen] : nullptr;
+                    usage.prev_use = last_use >= 0 ? tasks[last_use] : nullptr;
+                    last_use = i;
+                    // Set the previous' next to current task
+                    if (usage.prev_use) {
+                        usage.prev_use->find(usage.operand, false).next_use = task;
+                    }
+                    if (usage.gen) {
+                        auto &gen_usage = usage.gen->find(usage.operand);
+                        if (not gen_usage.next_use) {
+                            gen_usage.next_use = task;
+                        }
+                    }
+                }
+                for (auto &usage: task->outs) {
+                    if (mine(usage)) {
+                        usage.gen = task;
+                        gen[slot(usage)] = i;
+                        prev_use[slot(usage)] = -1;
+                    }
+                }
+            }
+
+            // Analyze next generation and last use
+            std::fill(gen.begin(), gen.end(), -1);
+            for (int i = count - 1; i >= 0; -- i) {
+                auto &task = tasks[i];
+                for (auto &usage: task->outs) {
+                    if (mine(usage)) {
+                        int &next_gen = gen[slot(usage)];
+                        usage.next_gen = next_gen >= 0 ? tasks[next_gen] : nullptr;
+                        next_gen = i;
+                    }
+                }
+                for (auto &usage: task->ins) {
+                    if (not mine(usage)) {
+                        continue;
+                    }
+                    int next_gen = gen[slot(usage)];
+                    usage.next_gen = next_gen >= 0 ? tasks[next_gen] : nullptr;
+                    if (usage.next_use) {
+                        auto &next_use = usage.next_use->find(usage.operand, false);
+                        usage.last_use = next_use.last_use ? next_use.last_use : usage.next_use;
+                    } else {
+                        usage.last_use = nullptr;
+                    }
+                }
+            }
+        });
+
+        // Versions hash the versions of inputs, so they follow the order of tasks
+        for (auto &task: tasks) {
             size_t hash = 0;
             for (auto &usage: task->ins) {
-                usage.gen = gen[usage.operand];
-                usage.prev_use = prev_use[usage.operand];
-                prev_use[usage.operand] = task;
-                // Set the previous' next to current task
-                if (usage.prev_use) {
-                    auto &prev_usage = usage.prev_use->find(usage.operand, false);
-                    prev_usage.next_use = task;
-                }
                 if (usage.gen) {
-                    auto &gen_usage = usage.gen->find(usage.operand);
-                    usage.version = gen_usage.version;
-                    if (not gen_usage.next_use) {
-                        gen_usage.next_use = task;
-                    }
+                    usage.version = usage.gen->find(usage.operand).version;
                 }
                 hash = hash * 131ull + usage.version;
             }
             for (auto &usage: task->outs) {
                 usage.version = hash * 131ull + usage.operand->id;
-                usage.gen = gen[usage.operand] = task;
-                usage.prev_use = prev_use[usage.operand] = nullptr;
             }
         }
 
-        // Analyze operands to dealloc
-        TaskHandle tail;
-        LOOP(task, head) {
-            for (auto &usage: task->ins) {
-                if (not usage.next_use and not not_dealloc.count(usage.operand) and not task->contains(usage.operand)) {
-                    task->to_dealloc_after.push_back(usage.operand);
+        // Analyze operands to dealloc, every thread takes a contiguous range of tasks
+        parallelFor(thread_count, [&](int thread) {
+            int begin = static_cast<long long>(count) * thread / thread_count, end = static_cast<long long>(count) * (thread + 1) / thread_count;
+            for (int i = begin; i < end; ++ i) {
+                auto &task = tasks[i];
+                for (auto &usage: task->ins) {
+                    if (not usage.next_use and not not_dealloc.count(usage.operand) and not task->contains(usage.operand)) {
+                        task->to_dealloc_after.push_back(usage.operand);
+                    }
                 }
-            }
-            for (auto &usage: task->outs) {
-                if (not usage.next_use and not not_dealloc.count(usage.operand)) {
-                    task->to_dealloc_after.push_back(usage.operand);
+                for (auto &usage: task->outs) {
+                    if (not usage.next_use and not not_dealloc.count(usage.operand)) {
+                        task->to_dealloc_after.push_back(usage.operand);
+                    }
                 }
             }
-            tail = task;
-        }
+        });
+    }
 
-        // Analyze next generation
-        gen.clear();
-        LOOP_BACK(task, tail) {
-            for (auto &usage: task->outs) {
-                usage.next_gen = gen[usage.operand];
-                gen[usage.operand] = task;
-            }
-            for (auto &usage: task->ins) {
-                usage.next_gen = gen[usage.operand];
-            }
+    uint64_t analyzeCommunication(TaskHandle &head) const {
+        // All-reduces run one at a time on their own stream, a task reading a gradient of a started bucket waits for
+        // it to complete. Returns the end of both streams
+        auto &model = *parallel;
+        int count = model.buckets.size();
+        std::vector<int> remaining(count);
+        std::vector<uint64_t> completion(count, 0);
+        std::vector<bool> started(count, false);
+        for (int i = 0; i < count; ++ i) {
+            remaining[i] = model.buckets[i].size();
         }
-
-        // Analyze last use
-        LOOP_BACK(task, tail) {
+        std::set<int> generated;
+        std::vector<int> order;
+        uint64_t clock = 0, stream = 0;
+        int completed = 0;
+        LOOP(task, head) {
+            task->ready_buckets.clear();
+            task->completed_buckets.clear();
             for (auto &usage: task->ins) {
-                if (usage.next_use) {
-                    auto &next_use = usage.next_use->find(usage.operand, false);
-                    usage.last_use = next_use.last_use ? next_use.last_use : usage.next_use;
-                } else {
-                    usage.last_use = nullptr;
+                int bucket = model.bucket(usage.operand->id);
+                if (bucket >= 0 and started[bucket]) {
+                    clock = std::max(clock, completion[bucket]);
+                }
+            }
+            clock += task->duration;
+            for (auto &usage: task->outs) {
+                int id = usage.operand->id, bucket = model.bucket(id);
+                if (bucket >= 0 and generated.insert(id).second and -- remaining[bucket] == 0) {
+                    size_t size = 0;
+                    for (int gradient: model.buckets[bucket]) {
+                        size += operands[gradient]->size;
+                    }
+                    stream = std::max(stream, clock) + model.allReduce(size);
+                    completion[bucket] = stream;
+                    started[bucket] = true;
+                    order.push_back(bucket);
+                    task->ready_buckets.push_back(bucket);
                 }
             }
+            while (completed < order.size() and completion[order[completed]] <= clock) {
+                task->completed_buckets.push_back(order[completed ++]);
+            }
         }
+        return std::max(clock, stream);
     }
 
-    static uint64_t analyzeTime(TaskHandle &head) {
+    uint64_t analyzeTime(TaskHandle &head) const {
+        // Durations of tasks are assumed to be independent, so variances are additive
         uint64_t total_time = 0;
+        double total_variance = 0;
         LOOP(task, head) {
             total_time += task->duration;
+            total_variance += task->variance;
+        }
+        if (parallel) {
+            total_time = analyzeCommunication(head);
         }
-        return total_time;
+        return total_time + static_cast<uint64_t>(std::max(time_z, 0.0) * std::sqrt(total_variance));
     }
 
-    size_t analyzeMemory(TaskHandle &head) const {
+    size_t analyzeMemory(TaskHandle &head, MemoryProfile &profile, bool detailed=false) const {
         // Analyze topology
         analyzeTopology(head);
+        if (parallel) {
+            analyzeCommunication(head);
+        }
+        profile = MemoryProfile();
+        std::vector<TaskHandle> tasks;
+        LOOP(task, head) {
+            tasks.push_back(task);
+        }
+        int count = tasks.size(), thread_count = analysisThreads(count);
 
-        // Operands already on device
+        // Memory changes by `delta[s]` from the task with time stamp `s` on, every bucket of gradients completes at a
+        // time stamp (after the end for never), and its flat buffer lives from the task after it is ready until then
         size_t current_memory = 0;
-        for (auto &operand: operands) {
-            operand->on_device = false;
-        }
         for (auto &operand: already_on) {
-            operand->on_device = true;
             current_memory += operand->size;
         }
-        size_t peak_memory = current_memory;
-
-        // Loop all tasks
-        LOOP(task, head) {
-            for (auto &usage: task->ins) {
-                assert(usage.operand->on_device);
+        std::vector<int> completion(parallel ? parallel->buckets.size() : 0, count + 1);
+        std::vector<long long> buffer_delta(count + 2, 0);
+        for (int i = 0; i < count and parallel; ++ i) {
+            for (auto bucket: tasks[i]->completed_buckets) {
+                completion[bucket] = i + 1;
             }
-            for (auto &usage: task->outs) {
-                if (not usage.operand->on_device) {
-                    usage.operand->on_device = true;
-                    current_memory += usage.operand->size;
+        }
+        for (int i = 0; i < count and parallel and parallel->buffer; ++ i) {
+            for (auto bucket: tasks[i]->ready_buckets) {
+                size_t size = 0;
+                for (int id: parallel->buckets[bucket]) {
+                    size += operands[id]->size;
                 }
+                buffer_delta[i + 2] += size;
+                buffer_delta[std::min(completion[bucket], count) + 1] -= size;
             }
-            task->execution_memory = current_memory + task->workspace;
-            peak_memory = std::max(peak_memory, task->execution_memory);
+        }
 
-            for (auto &operand: task->to_dealloc_after) {
+        // Allocations and frees of different operands are independent, every thread replays the operands with ids in
+        // its residue class into its own deltas. Live intervals `[begin, end]` in time stamps are only recorded for a
+        // detailed profile (dominating operands of regions and live operands at the peak), the search never asks for it.
+        // Gradients of buckets not completed yet are freed when their all-reduce completes
+        struct Interval {
+            OperandHandle operand;
+            int begin, end;
+        };
+        std::vector<std::vector<long long>> deltas(thread_count);
+        std::vector<std::vector<Interval>> intervals(thread_count);
+        int max_id = 0;
+        for (auto &operand: operands) {
+            max_id = std::max(max_id, operand->id);
+        }
+        parallelFor(thread_count, [&](int thread) {
+            auto &delta = deltas[thread];
+            delta.assign(count + 2, 0);
+            std::vector<int> begin(max_id / thread_count + 1, 0), deferred(begin.size(), 0);
+            auto slot = [thread_count](const OperandHandle &operand) {
+                return operand->id / thread_count;
+            };
+            auto free = [&](const OperandHandle &operand, int time_stamp) {
                 operand->on_device = false;
-                current_memory -= operand->size;
+                delta[time_stamp + 1] -= operand->size;
+                if (detailed) {
+                    intervals[thread].push_back(Interval {operand, begin[slot(operand)], time_stamp});
+                }
+            };
+            for (auto &operand: operands) {
+                if (operand->id % thread_count == thread) {
+                    operand->on_device = already_on.count(operand) > 0;
+                }
+            }
+            for (int i = 0; i < count; ++ i) {
+                int time_stamp = i + 1;
+                auto &task = tasks[i];
+                for (auto &usage: task->ins) {
+                    assert(usage.operand->id % thread_count != thread or usage.operand->on_device);
+                }
+                for (auto &usage: task->outs) {
+                    auto &operand = usage.operand;
+                    if (operand->id % thread_count != thread) {
+                        continue;
+                    }
+                    // A deferred free completed before this task, or generated again before it, so it stays
+                    int &pending = deferred[slot(operand)];
+                    if (pending > 0 and pending < time_stamp) {
+                        free(operand, pending);
+                    }
+                    pending = 0;
+                    if (not operand->on_device) {
+                        operand->on_device = true;
+                        delta[time_stamp] += operand->size;
+                        begin[slot(operand)] = time_stamp;
+                    }
+                }
+                for (auto &operand: task->to_dealloc_after) {
+                    if (operand->id % thread_count != thread) {
+                        continue;
+                    }
+                    int bucket = parallel ? parallel->bucket(operand->id) : -1;
+                    if (bucket >= 0 and completion[bucket] > time_stamp) {
+                        deferred[slot(operand)] = completion[bucket];
+                    } else {
+                        free(operand, time_stamp);
+                    }
+                }
+            }
+            for (auto &operand: operands) {
+                if (operand->id % thread_count != thread or not operand->on_device) {
+                    continue;
+                }
+                int pending = deferred[slot(operand)];
+                if (pending > 0 and pending <= count) {
+                    free(operand, pending);
+                } else if (detailed) {
+                    intervals[thread].push_back(Interval {operand, begin[slot(operand)], count});
+                }
+            }
+        });
+
+        // Parallel prefix sum of the deltas over contiguous ranges of tasks, and the maximum of every range
+        std::vector<long long> range_sum(thread_count, 0);
+        std::vector<size_t> range_max(thread_count, 0);
+        auto range = [count, thread_count](int thread) {
+            return std::make_pair(static_cast<int>(static_cast<long long>(count) * thread / thread_count + 1),
+                                  static_cast<int>(static_cast<long long>(count) * (thread + 1) / thread_count + 1));
+        };
+        parallelFor(thread_count, [&](int thread) {
+            auto bounds = range(thread);
+            for (int s = bounds.first; s < bounds.second; ++ s) {
+                for (int t = 1; t < thread_count; ++ t) {
+                    deltas[0][s] += deltas[t][s];
+                }
+                deltas[0][s] += buffer_delta[s];
+                range_sum[thread] += deltas[0][s];
+            }
+        });
+        std::vector<long long> range_begin(thread_count, current_memory);
+        for (int t = 1; t < thread_count; ++ t) {
+            range_begin[t] = range_begin[t - 1] + range_sum[t - 1];
+        }
+        parallelFor(thread_count, [&](int thread) {
+            auto bounds = range(thread);
+            long long memory = range_begin[thread];
+            for (int s = bounds.first; s < bounds.second; ++ s) {
+                memory += deltas[0][s];
+                auto &task = tasks[s - 1];
+                task->time_stamp = s;
+                task->execution_memory = memory + task->workspace;
+                range_max[thread] = std::max(range_max[thread], task->execution_memory);
+            }
+        });
+        size_t peak_memory = std::max(current_memory, *std::max_element(range_max.begin(), range_max.end()));
+
+        // Local maxima are the first of plateaus
+        bool rising = true, in_region = false;
+        MemoryProfile::Peak last;
+        for (auto &task: tasks) {
+            int time_stamp = task->time_stamp;
+            if (task->execution_memory >= profile.peak.memory) {
+                profile.peak = MemoryProfile::Peak {time_stamp, task->execution_memory};
+            }
+            if (task->execution_memory < last.memory and rising) {
+                profile.addPeak(last);
+            }
+            if (task->execution_memory != last.memory) {
+                rising = task->execution_memory > last.memory;
+            }
+            if (task->execution_memory != last.memory or time_stamp == 1) {
+                last = MemoryProfile::Peak {time_stamp, task->execution_memory};
+            }
+
+            // Regions above the limit
+            if (limit > 0 and task->execution_memory > limit) {
+                if (not in_region) {
+                    in_region = true;
+                    profile.regions.emplace_back();
+                    profile.regions.back().begin = time_stamp;
+                }
+                auto &region = profile.regions.back();
+                region.end = time_stamp;
+                if (task->execution_memory > region.peak.memory) {
+                    region.peak = MemoryProfile::Peak {time_stamp, task->execution_memory};
+                }
+            } else {
+                in_region = false;
+            }
+        }
+        if (rising and count > 0) {
+            profile.addPeak(last);
+        }
+
+        // Largest operands live at the peak of every region, from the intervals of every thread
+        typedef std::pair<size_t, OperandHandle> Candidate;
+        std::vector<int> stamps;
+        for (int r = 0; detailed and r < profile.regions.size(); ++ r) {
+            stamps.push_back(profile.regions[r].peak.time_stamp);
+        }
+        std::vector<std::vector<std::vector<Candidate>>> candidates(thread_count, std::vector<std::vector<Candidate>>(stamps.size()));
+        auto keep = [](std::vector<Candidate> &largest, const Candidate &candidate) {
+            largest.insert(std::upper_bound(largest.begin(), largest.end(), candidate, std::greater<Candidate>()), candidate);
+            if (largest.size() > MemoryProfile::DOMINATING_OPERANDS) {
+                largest.pop_back();
+            }
+        };
+        if (not stamps.empty()) {
+            parallelFor(thread_count, [&](int thread) {
+                for (auto &interval: intervals[thread]) {
+                    auto it = std::lower_bound(stamps.begin(), stamps.end(), interval.begin);
+                    for (; it != stamps.end() and *it <= interval.end; ++ it) {
+                        keep(candidates[thread][it - stamps.begin()], std::make_pair(interval.operand->size, interval.operand));
+                    }
+                }
+            });
+        }
+        for (int r = 0; r < stamps.size(); ++ r) {
+            std::vector<Candidate> largest;
+            for (int t = 0; t < thread_count; ++ t) {
+                for (auto &candidate: candidates[t][r]) {
+                    keep(largest, candidate);
+                }
+            }
+            for (auto &candidate: largest) {
+                profile.regions[r].dominating.push_back(candidate.second);
+            }
+        }
+        if (detailed) {
+            int peak_time_stamp = profile.peak.time_stamp;
+            std::vector<Candidate> all;
+            for (auto &list: intervals) {
+                for (auto &interval: list) {
+                    if (interval.begin <= peak_time_stamp and peak_time_stamp <= interval.end) {
+                        all.emplace_back(interval.operand->size, interval.operand);
+                    }
+                }
+            }
+            std::sort(all.begin(), all.end(), std::greater<Candidate>());
+            for (auto &candidate: all) {
+                profile.live.push_back(candidate.second);
             }
         }
         return peak_memory;
@@ -552,73 +1159,38 @@ struct Common {
         }
     }
 
-    static std::vector<Occupy> analyzeOccupies(TaskHandle &head, size_t peak_memory, uint64_t origin_time) {
-        // Run this function after running analyzeTopology and analyzeMemory
-        // Mark tasks and get the peak one
-        int time_stamp = 0, peak_time_stamp = 0;
-        LOOP(task, head) {
-            task->time_stamp = ++ time_stamp;
-            if (task->execution_memory == peak_memory) {
-                peak_time_stamp = time_stamp;
-            }
-        }
+    template <typename Cost=BalancedCost>
+    std::vector<Occupy> analyzeOccupies(TaskHandle &head, const MemoryProfile &profile, uint64_t origin_time) const {
+        // Run this function after running analyzeTopology and analyzeMemory (tasks are marked with time stamps)
+        int peak_time_stamp = profile.peak.time_stamp;
+        size_t peak_memory = profile.peak.memory;
         assert(peak_time_stamp > 0);
 
-        // Check
-        auto append = [](Occupy &occupy) -> bool {
-            auto &gen = occupy.gen;
-            auto &use = occupy.use;
-            occupy.re_gen_ins.insert(gen->ins.begin(), gen->ins.end());
-
-            // We're going to put `gen` before `use`, so we must ensure the inputs of `gen` will not change
-            static constexpr int RE_GEN_TASK_LIMIT = 3;
-            for (int i = -1; i < RE_GEN_TASK_LIMIT; ++ i) {
-                bool found = false;
-                OperandUsage bad_usage;
-                for (auto &usage: occupy.re_gen_ins) {
-                    auto last_gen_before_re_gen = usage.next_gen;
-                    while (last_gen_before_re_gen) {
-                        auto &re_gen = last_gen_before_re_gen->find(usage.operand);
-                        if (re_gen.next_gen and re_gen.next_gen->time_stamp < use->time_stamp) {
-                            last_gen_before_re_gen = re_gen.next_gen;
-                        } else {
-                            break;
-                        }
-                    }
-                    if (last_gen_before_re_gen and last_gen_before_re_gen->time_stamp < use->time_stamp) {
-                        auto &re_gen = last_gen_before_re_gen->find(usage.operand);
-                        if (re_gen.version != usage.version) {
-                            found = true;
-                            bad_usage = usage;
-                            break;
+        // Get all occupying pairs, operands too small to matter at the peak are skipped (relative to the gap above
+        // the limit, which shrinks while searching, or to the peak), the filter is dropped if nothing remains
+        std::set<Occupy> occupies;
+        size_t threshold = 0;
+        if (limit > 0 and peak_memory > limit) {
+            threshold = static_cast<size_t>(std::min(FILTER_GAP_RATIO * (peak_memory - limit), FILTER_PEAK_RATIO * peak_memory));
+        }
+        for (bool filtered = threshold > 0; occupies.empty(); filtered = false) {
+            LOOP(task, head) {
+                if (peak_time_stamp >= task->time_stamp) {
+                    continue;
+                }
+                for (auto &usage: task->ins) {
+                    if (usage.gen and usage.gen->time_stamp < peak_time_stamp and (not filtered or usage.operand->size >= threshold)
+                        and (focus.empty() or focus.count(usage.gen->id))) {
+                        auto occupy = Occupy {usage.gen, task};
+                        // .count is a must, because we only accept the first usage
+                        if (not occupies.count(occupy) and occupy.resolve()) {
+                            occupies.insert(occupy);
                         }
                     }
                 }
-                if (found) {
-                    occupy.re_gen.push_back(bad_usage.gen);
-                    occupy.re_gen_ins.erase(bad_usage);
-                    occupy.re_gen_ins.insert(bad_usage.gen->ins.begin(), bad_usage.gen->ins.end());
-                } else {
-                    return true;
-                }
             }
-            return false;
-        };
-
-        // Get all occupying pairs
-        std::set<Occupy> occupies;
-        LOOP(task, head) {
-            if (peak_time_stamp >= task->time_stamp) {
-                continue;
-            }
-            for (auto &usage: task->ins) {
-                if (usage.gen and usage.gen->time_stamp < peak_time_stamp) {
-                    auto occupy = Occupy {usage.gen, task};
-                    // .count is a must, because we only accept the first usage
-                    if (not occupies.count(occupy) and append(occupy)) {
-                        occupies.insert(occupy);
-                    }
-                }
+            if (not filtered) {
+                break;
             }
         }
 
@@ -626,7 +1198,7 @@ struct Common {
         std::vector<Occupy> occupies_vec;
         for (auto &occupy: occupies) {
             auto copied = occupy;
-            copied.calculate(peak_time_stamp, peak_memory, origin_time);
+            copied.calculate<Cost>(peak_time_stamp, peak_memory, origin_time, time_z);
             occupies_vec.push_back(copied);
         }
 
@@ -678,6 +1250,33 @@ struct Common {
         tail->next = nullptr;
     }
 
+    static void expand(TaskHandle &head, bool blocks_only=false) {
+        // Replace tasks with their origin tasks (maybe nested)
+        for (auto task = head; task; ) {
+            if (task->fused.empty() or (blocks_only and not task->isBlock())) {
+                task = task->next;
+                continue;
+            }
+            auto prev = task->prev, next = task->next, first = TaskHandle();
+            for (auto &fused: task->fused) {
+                auto new_task = fused->copy();
+                new_task->prev = prev;
+                if (prev) {
+                    prev->next = new_task;
+                } else {
+                    head = new_task;
+                }
+                first = first ? first : new_task;
+                prev = new_task;
+            }
+            prev->next = next;
+            if (next) {
+                next->prev = prev;
+            }
+            task = first;
+        }
+    }
+
     void restore(TaskHandle &head) {
         auto insert_between = [](TaskHandle &first, TaskHandle &new_task, TaskHandle &second) {
             new_task->next = second;
@@ -690,31 +1289,45 @@ struct Common {
             }
         };
 
+        // Expand simulated fusions and super-tasks
+        expand(head);
+
         // Restore .share
         std::set<OperandHandle> restored;
         LOOP(task, head) {
-            if (real_task.count(task->id)) {
-                std::vector<TaskHandle> to_insert;
-                auto restore = [&restored, &to_insert](std::vector<OperandUsage> &origin, std::vector<OperandUsage> &current) {
+            auto it = real_task.find(task->id);
+            auto origin = task->origin_names ? task->origin_names : (it != real_task.end() ? it->second : nullptr);
+            if (origin) {
+                std::vector<TaskHandle> to_insert, to_insert_after;
+                auto restore = [&restored, &to_insert, &to_insert_after, &task](std::vector<OperandUsage> &origin, std::vector<OperandUsage> &current, bool is_out) {
                     for (int i = 0; i < origin.size(); ++ i) {
                         if (origin[i].operand != current[i].operand) {
+                            // Rewritten in-place output, the origin name becomes a view after the task
+                            bool inplace = is_out and task->contains(current[i].operand, false);
                             if (not restored.count(origin[i].operand)) {
                                 restored.insert(origin[i].operand);
                                 auto new_task = Task::share(current[i].operand, origin[i].operand);
-                                to_insert.push_back(new_task);
+                                (inplace ? to_insert_after : to_insert).push_back(new_task);
+                            }
+                            if (not inplace) {
+                                current[i].operand = origin[i].operand;
                             }
-                            current[i].operand = origin[i].operand;
                         }
                     }
                 };
-                restore(real_task[task->id]->ins, task->ins);
-                restore(real_task[task->id]->outs, task->outs);
-                if (not to_insert.empty()) {
-                    auto prev = task->prev;
-                    for (auto &new_task: to_insert) {
-                        insert_between(prev, new_task, task);
-                        prev = new_task;
+                restore(origin->ins, task->ins, false);
+                restore(origin->outs, task->outs, true);
+                auto prev = task->prev;
+                for (auto &new_task: to_insert) {
+                    insert_between(prev, new_task, task);
+                    if (not prev) {
+                        head = new_task;
                     }
+                    prev = new_task;
+                }
+                for (auto &new_task: to_insert_after) {
+                    insert_between(task, new_task, task->next);
+                    task = new_task;
                 }
             }
         }
@@ -732,9 +1345,21 @@ struct Common {
             }
         }
 
-        // Add attributes
+        // Add attributes, split tasks are emitted as copies tagged with their slice indices, consumers must honor the tag
         LOOP(task, head) {
             task->attr = attrs[task->id];
+            for (int i = 0; task->split > 1 and i < task->split; ++ i) {
+                auto chunk = i + 1 < task->split ? task->copy() : task;
+                chunk->attr = attrs[task->id];
+                chunk->attr["split"] = {{"index", i}, {"count", task->split}};
+                if (chunk != task) {
+                    auto prev = task->prev;
+                    insert_between(prev, chunk, task);
+                    if (not prev) {
+                        head = chunk;
+                    }
+                }
+            }
         }
     }
 
@@ -764,6 +1389,12 @@ struct Common {
     }
 };
 
+// A re-computation in task ids, which stay the same across copies
+struct Decision {
+    int gen = 0, use = 0;
+    bool move = false, gen_recomputed = false, use_recomputed = false;
+};
+
 struct Schedule {
     // Structure
     CommonHandle common;
@@ -773,7 +1404,7 @@ struct Schedule {
     bool analyzed = false;
     size_t peak_memory = 0;
     uint64_t total_time = 0;
-    std::vector<Occupy> occupies;
+    MemoryProfile profile;
 
     // Hash
     bool hash_calculated = false;
@@ -783,16 +1414,58 @@ struct Schedule {
         if (not analyzed) {
             analyzed = true;
             total_time = common->analyzeTime(head);
-            peak_memory = common->analyzeMemory(head);
-            occupies = common->analyzeOccupies(head, peak_memory, total_time);
+            peak_memory = common->analyzeMemory(head, profile);
         }
         return std::make_pair(peak_memory, total_time);
     }
 
+    // Also dominating operands of the regions above the limit and live operands at the peak, only for reports
+    void analyzeProfile() {
+        analyze();
+        common->analyzeMemory(head, profile, true);
+    }
+
+    // Re-computation candidates on the analysis, scored by a cost model when the schedule is expanded
+    template <typename Cost=BalancedCost>
+    std::vector<Occupy> analyzeOccupies() {
+        analyze();
+        return common->analyzeOccupies<Cost>(head, profile, total_time);
+    }
+
+    ScheduleHandle copy() const {
+        auto new_schedule = std::make_shared<Schedule>();
+        new_schedule->common = common;
+        TaskHandle tail;
+        LOOP(task, head) {
+            auto new_task = task->copy();
+            if (not tail) {
+                new_schedule->head = new_task;
+            } else {
+                tail->next = new_task;
+                new_task->prev = tail;
+            }
+            tail = new_task;
+        }
+        return new_schedule;
+    }
+
     ScheduleHandle apply(const Occupy &occupy) const {
+        return apply(std::vector<Occupy> {occupy});
+    }
+
+    // Re-computations resolved on the same analysis, each inserted before its own `use`
+    ScheduleHandle apply(const std::vector<Occupy> &occupies) const {
         // Generate new
         auto new_schedule = std::make_shared<Schedule>();
         new_schedule->common = common;
+        std::map<TaskHandle, std::vector<const Occupy*>> inserted;
+        std::set<TaskHandle> moved;
+        for (auto &occupy: occupies) {
+            inserted[occupy.use].push_back(&occupy);
+            if (occupy.move) {
+                moved.insert(occupy.gen);
+            }
+        }
 
         // Copy list and insert re-computation
         auto &new_head = new_schedule->head;
@@ -809,13 +1482,16 @@ struct Schedule {
             tail = task;
         };
         LOOP(task, head) {
-            if (task == occupy.use) {
-                for (auto it = occupy.re_gen.rbegin(); it != occupy.re_gen.rend(); ++ it) {
-                    insert_back((*it)->copy());
+            auto it = inserted.find(task);
+            if (it != inserted.end()) {
+                for (auto occupy: it->second) {
+                    for (auto re_gen = occupy->re_gen.rbegin(); re_gen != occupy->re_gen.rend(); ++ re_gen) {
+                        insert_back((*re_gen)->recompute());
+                    }
+                    insert_back(occupy->move ? occupy->gen->copy() : occupy->gen->recompute());
                 }
-                insert_back(occupy.gen->copy());
             }
-            if (not (task == occupy.gen and occupy.move)) {
+            if (not moved.count(task)) {
                 insert_back(task->copy());
             }
         }
@@ -825,42 +1501,49 @@ struct Schedule {
 
     static std::pair<ScheduleHandle, int> fromFile(const std::string &path) {
         // Read JSON
-        std::ifstream file(path);
-        nlohmann::json json;
-        file >> json;
+        auto json = PatternReader::fromFile(path);
+        return fromJson(json, path);
+    }
 
+    static std::pair<ScheduleHandle, int> fromJson(nlohmann::json &json, const std::string &name) {
         // Operands
         auto schedule = std::make_shared<Schedule>();
         schedule->common = Common::fromJson(json);
 
-        // Records
-        int count = 0;
-        TaskHandle tail;
-        for (auto &item: json["code"]) {
-            auto task = Task::fromJson(++ count, schedule->common->operands, item);
-            if (not tail) {
-                schedule->head = task;
-                tail = task;
-            } else {
-                tail->next = task;
-                task->prev = tail;
-                tail = task;
+        // Records, built concurrently in contiguous ranges and linked in order
+        const auto &code = json["code"];
+        int count = code.size(), threads = schedule->common->analysisThreads(count);
+        std::vector<TaskHandle> tasks(count);
+        parallelFor(threads, [&](int thread) {
+            int begin = static_cast<long long>(count) * thread / threads, end = static_cast<long long>(count) * (thread + 1) / threads;
+            for (int i = begin; i < end; ++ i) {
+                tasks[i] = Task::fromJson(i + 1, schedule->common->operands, code[i]);
             }
+        });
+        for (int i = 0; i < count; ++ i) {
+            tasks[i]->prev = i > 0 ? tasks[i - 1] : nullptr;
+            tasks[i]->next = i + 1 < count ? tasks[i + 1] : nullptr;
         }
-        tail->next = nullptr;
-
-        // Analyze common elements and refactor to the format without .dealloc and .share
-        schedule->common->recordAttributes(schedule->head);
-        schedule->common->analyzePlacement(schedule->head);
-        if (not schedule->common->check(schedule->head)) {
-            error("Origin schedule in file %s check failed.", path.c_str());
-        }
-        schedule->common->analyzeShare(schedule->head);
-        schedule->common->refactor(schedule->head);
+        schedule->head = count > 0 ? tasks.front() : nullptr;
+        schedule->prepare(name);
 
         return std::make_pair(schedule, count);
     }
 
+    // Analyze common elements and refactor to the format without .dealloc and .share
+    void prepare(const std::string &name) {
+        if (not head) {
+            error("Origin schedule %s is empty.\n", name.c_str());
+        }
+        common->recordAttributes(head);
+        common->analyzePlacement(head);
+        if (not common->check(head)) {
+            error("Origin schedule in file %s check failed.", name.c_str());
+        }
+        common->analyzeShare(head);
+        common->refactor(head);
+    }
+
     void restoreAndDumpToFile(const std::string &path) {
         // Restore to the format with attributes, .dealloc and .share
         common->restore(head);
@@ -889,38 +1572,66 @@ struct Schedule {
         hash_calculated = true;
         hash_value = 0;
         LOOP(task, head) {
-            hash_value = hash_value * 131ull + task->id;
+            hash_value = hash_value * 131ull + task->id * 2ull + task->inplace;
+            if (task->split > 1) {
+                hash_value = hash_value * 131ull + task->split;
+            }
         }
         return hash_value;
     }
 };
 
-struct Comparator {
+// Objectives weigh memory above the limit against time above the origin while the limit is not reached
+struct BalancedObjective {
+    static constexpr double MEMORY_FACTOR = 0.6;
+
+    static std::string name() {
+        return "balanced";
+    }
+};
+
+// Weighs the memory above the limit more, fewer expansions are spent on time while far from it
+struct MemoryObjective {
+    static constexpr double MEMORY_FACTOR = 0.7;
+
+    static std::string name() {
+        return "memory";
+    }
+};
+
+template <typename Objective>
+struct ObjectiveComparator {
     uint64_t origin_time;
     size_t limit;
 
-    static constexpr double MEMORY_FACTOR = 0.6;
+    static constexpr double MEMORY_FACTOR = Objective::MEMORY_FACTOR;
     static constexpr double TIME_FACTOR = 1.0 - MEMORY_FACTOR;
     static constexpr double RECONSIDER_RATIO = 1.2;
     static constexpr double TIME_REQUIREMENT_RATIO = 1.01;
 
-    double score(const ScheduleHandle &s) const {
+    // Statistics are `(peak_memory, total_time)` pairs, so analyzed schedules can be compared without handles
+    double score(const std::pair<size_t, uint64_t> &s) const {
         size_t peak_memory;
         uint64_t total_time;
-        std::tie(peak_memory, total_time) = s->analyze();
+        std::tie(peak_memory, total_time) = s;
 
         // Using exceeded ratio to compare, lower is better
         double exceeded_memory_ratio = peak_memory > limit ? (static_cast<double>(peak_memory - limit) / limit) : 0;
-        double exceeded_time_ratio = static_cast<double>(total_time - origin_time) / origin_time;
+        // In doubles, a schedule faster than the origin has a negative ratio instead of a wrapped-around one
+        double exceeded_time_ratio = (static_cast<double>(total_time) - origin_time) / origin_time;
         return MEMORY_FACTOR * exceeded_memory_ratio + TIME_FACTOR * exceeded_time_ratio;
     }
 
-    bool operator () (const ScheduleHandle &s1, const ScheduleHandle &s2) const {
+    double score(const ScheduleHandle &s) const {
+        return score(s->analyze());
+    }
+
+    bool operator () (const std::pair<size_t, uint64_t> &s1, const std::pair<size_t, uint64_t> &s2) const {
         // Whether reaching limit
         size_t s1_peak_memory, s2_peak_memory;
         uint64_t s1_total_time, s2_total_time;
-        std::tie(s1_peak_memory, s1_total_time) = s1->analyze();
-        std::tie(s2_peak_memory, s2_total_time) = s2->analyze();
+        std::tie(s1_peak_memory, s1_total_time) = s1;
+        std::tie(s2_peak_memory, s2_total_time) = s2;
         if ((s1_peak_memory <= limit) != (s2_peak_memory <= limit)) {
             return s2_peak_memory <= limit;
         } else if (s1_peak_memory <= limit) {
@@ -931,15 +1642,26 @@ struct Comparator {
         return score(s1) > score(s2);
     }
 
+    bool operator () (const ScheduleHandle &s1, const ScheduleHandle &s2) const {
+        return (*this)(s1->analyze(), s2->analyze());
+    }
+
+    bool satisfy(const std::pair<size_t, uint64_t> &s) const {
+        return s.first <= limit && s.second <= TIME_REQUIREMENT_RATIO * origin_time;
+    }
+
     bool satisfy(const ScheduleHandle &s) const {
-        size_t peak_memory;
-        uint64_t total_time;
-        std::tie(peak_memory, total_time) = s->analyze();
-        return peak_memory <= limit && total_time <= TIME_REQUIREMENT_RATIO * origin_time;
+        return satisfy(s->analyze());
     }
 
-    bool considerable(const ScheduleHandle &s1, const ScheduleHandle &s2) const {
+    bool considerable(const std::pair<size_t, uint64_t> &s1, const std::pair<size_t, uint64_t> &s2) const {
         // Return whether `s2` is considerable comparing to `s1` (possibly the best)
         return score(s1) * RECONSIDER_RATIO > score(s2);
     }
+
+    bool considerable(const ScheduleHandle &s1, const ScheduleHandle &s2) const {
+        return considerable(s1->analyze(), s2->analyze());
+    }
 };
+
+typedef ObjectiveComparator<BalancedObjective> Comparator;
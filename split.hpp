@@ -0,0 +1,149 @@
+#pragma once
+
+#include <fstream>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "json.hpp"
+#include "scaling.hpp"
+#include "schedule.hpp"
+#include "utils.hpp"
+
+// Cost of running a task as sequential micro-tasks over the batch dimension, per operator
+struct SplitModel {
+    static constexpr int MAX_COUNT = 8;
+
+    struct Cost {
+        // Time of every extra micro-task (launch and synchronization)
+        uint64_t launch = 5000;
+
+        // Time lost by every extra micro-task relative to the whole task (smaller kernels are less efficient)
+        double slowdown = 0.05;
+    };
+
+    std::map<std::string, Cost> costs;
+
+    // Operands with the batch as the leading dimension, filled by `prepare`
+    int base = 0;
+    std::vector<bool> batched;
+
+    // Operators independent across samples, batch normalization and losses reduce over the batch
+    static SplitModel defaults() {
+        SplitModel model;
+        for (auto &name: {"conv", "conv2d", "convolution", "conv_backward_data", "matmul", "mm", "bmm", "linear", "gemm",
+                          "relu", "relu6", "gelu", "sigmoid", "tanh", "add", "sub", "mul", "div", "bias_add", "softmax",
+                          "attention", "embedding", "pool", "max_pool", "avg_pool"}) {
+            model.costs[name] = Cost();
+        }
+        return model;
+    }
+
+    // `{"<operator>": {"launch": <ns>, "slowdown": <ratio>}}`, only operators listed are split
+    static SplitModel fromFile(const std::string &path) {
+        std::ifstream file(path);
+        if (not file) {
+            error("Failed to open split model %s\n", path.c_str());
+        }
+        nlohmann::json json;
+        file >> json;
+        SplitModel model;
+        for (auto it = json.begin(); it != json.end(); ++ it) {
+            auto &cost = model.costs[it.key()];
+            cost.launch = it.value().value("launch", cost.launch);
+            cost.slowdown = it.value().value("slowdown", cost.slowdown);
+        }
+        return model;
+    }
+
+    void prepare(const ScheduleHandle &schedule) {
+        base = BatchScaling::inferBase(*schedule->common);
+        if (base == 0) {
+            warning("No shapes to find the batch dimension, tasks will not be split\n");
+            return;
+        }
+        batched = BatchScaling::infer(schedule, base).scaled;
+    }
+
+    // Every output and at least one input are batched
+    bool splittable(const TaskHandle &task) const {
+        if (base < 2 or task->split > 1 or not task->fused.empty() or not costs.count(task->name) or task->outs.empty()) {
+            return false;
+        }
+        for (auto &usage: task->outs) {
+            if (not batched[usage.operand->id]) {
+                return false;
+            }
+        }
+        for (auto &usage: task->ins) {
+            if (batched[usage.operand->id]) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    uint64_t duration(const std::string &name, uint64_t duration, int count) const {
+        auto &cost = costs.at(name);
+        return static_cast<uint64_t>(duration * (1 + cost.slowdown * (count - 1))) + cost.launch * (count - 1);
+    }
+};
+
+constexpr int SplitModel::MAX_COUNT;
+
+// A task around the peak whose workspace shrinks by running it in `count` micro-tasks, outputs are not chunked
+struct SplitCandidate {
+    TaskHandle task;
+    int count = 1;
+    size_t memory_saved = 0;
+};
+
+class SplitRewrite {
+    // Only tasks whose execution memory is this close to the peak are considered
+    static constexpr double PEAK_RATIO = 0.9;
+
+    static size_t chunk(size_t size, int count) {
+        return (size + count - 1) / count;
+    }
+
+public:
+    // Micro-tasks take the whole inputs and outputs, only the workspace is per micro-task (no output assembly is modelled)
+    static void split(const TaskHandle &task, int count, const SplitModel &model) {
+        double ratio = static_cast<double>(model.duration(task->name, task->duration, count)) / std::max<uint64_t>(task->duration, 1);
+        task->split = count;
+        task->duration = model.duration(task->name, task->duration, count);
+        task->recompute_duration = model.duration(task->name, task->recompute_duration, count);
+        task->variance *= ratio * ratio;
+        task->workspace = chunk(task->workspace, count);
+        task->recompute_workspace = chunk(task->recompute_workspace, count);
+    }
+
+    // Run after analyzing the schedule with a split model, only tasks with a workspace save memory
+    static std::vector<SplitCandidate> analyze(const ScheduleHandle &schedule) {
+        schedule->analyze();
+        auto &model = *schedule->common->split;
+        std::vector<SplitCandidate> candidates;
+        LOOP(task, schedule->head) {
+            if (task->workspace == 0 or task->execution_memory < PEAK_RATIO * schedule->peak_memory or not model.splittable(task)) {
+                continue;
+            }
+            for (int count = 2; count <= std::min(SplitModel::MAX_COUNT, model.base); count *= 2) {
+                candidates.push_back(SplitCandidate {task, count, task->workspace - chunk(task->workspace, count)});
+            }
+        }
+        return candidates;
+    }
+
+    static ScheduleHandle apply(const ScheduleHandle &schedule, const SplitCandidate &candidate) {
+        auto new_schedule = schedule->copy();
+        // Time stamps are the positions in the analyzed schedule
+        int position = 0;
+        LOOP(task, new_schedule->head) {
+            if (++ position == candidate.task->time_stamp) {
+                split(task, candidate.count, *schedule->common->split);
+                break;
+            }
+        }
+        return new_schedule;
+    }
+};
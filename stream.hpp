@@ -0,0 +1,279 @@
+#pragma once
+
+#include <fstream>
+#include <functional>
+#include <iterator>
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+
+#include "json.hpp"
+#include "optimizer.hpp"
+#include "schedule.hpp"
+#include "timer.hpp"
+#include "utils.hpp"
+
+// Optimizes a trace window by window, only the operands living across the window boundary are kept
+class Streamer {
+    size_t limit;
+    int window_size;
+    bool inplace;
+
+    // Operand sizes, the only state growing with the trace
+    nlohmann::json inputs, outputs, version;
+    std::vector<size_t> sizes;
+
+    // Live operands at the emitted boundary, and the searched but not emitted window
+    std::set<int> live;
+    std::vector<nlohmann::json> carried;
+
+    // Statistics
+    int windows = 0, count = 0, searched = 0;
+    bool emitted = false;
+    size_t origin_peak_memory = 0, peak_memory = 0;
+    uint64_t total_time = 0;
+
+    // Stream elements of `code` or `data` to `callback` and discard them, other top-level fields are kept in the returned JSON
+    static nlohmann::json parse(const std::string &path, const std::string &streamed, const std::function<void(nlohmann::json&)> &callback) {
+        std::ifstream file(path);
+        if (not file) {
+            error("Failed to open %s\n", path.c_str());
+        }
+        std::string key;
+        return nlohmann::json::parse(file, [&](int depth, nlohmann::json::parse_event_t event, nlohmann::json &parsed) {
+            if (depth == 1 and event == nlohmann::json::parse_event_t::key) {
+                key = parsed;
+            } else if (depth == 2 and event == nlohmann::json::parse_event_t::object_end and (key == "code" or key == "data")) {
+                if (key == streamed) {
+                    callback(parsed);
+                }
+                return false;
+            }
+            return true;
+        });
+    }
+
+    // Load items (global operand IDs) as a schedule, `code[i]` is the item of the task with ID `i + 1`
+    ScheduleHandle load(const std::vector<nlohmann::json> &items, const std::string &name, std::vector<nlohmann::json> &code,
+                        std::vector<int> &positions, std::set<int> &appeared, std::set<int> &early, size_t &pass_through) {
+        // Operands freed here but coming from earlier windows without uses here are freed at the beginning
+        for (int i = 0; i < static_cast<int>(items.size()); ++ i) {
+            auto item = items[i];
+            if (item["name"] == ".dealloc") {
+                auto outs = nlohmann::json::array();
+                for (auto &id: item["outs"]) {
+                    if (appeared.count(static_cast<int>(id))) {
+                        outs.push_back(id);
+                    } else {
+                        early.insert(static_cast<int>(id));
+                    }
+                }
+                if (outs.empty()) {
+                    continue;
+                }
+                item["outs"] = outs;
+            } else {
+                for (auto &id: item["ins"]) {
+                    appeared.insert(static_cast<int>(id));
+                }
+                for (auto &id: item["outs"]) {
+                    appeared.insert(static_cast<int>(id));
+                }
+            }
+            code.push_back(item);
+            positions.push_back(i);
+        }
+
+        // Remap operands into a compact local table
+        std::map<int, int> local;
+        nlohmann::json window;
+        window["data"] = nlohmann::json::array();
+        for (int id: appeared) {
+            int local_id = local.size();
+            local[id] = local_id;
+            nlohmann::json operand = {{"id", local[id]}, {"size", sizes[id]}};
+            window["data"].push_back(operand);
+        }
+        auto remap = [&local](nlohmann::json &ids) {
+            for (auto &id: ids) {
+                id = local[static_cast<int>(id)];
+            }
+        };
+        window["code"] = code;
+        for (auto &item: window["code"]) {
+            remap(item["ins"]);
+            remap(item["outs"]);
+        }
+        window["inputs"] = window["outputs"] = nlohmann::json::array();
+        window["version"] = version;
+
+        // Operands living through the whole window take the budget
+        pass_through = 0;
+        for (int id: live) {
+            if (not appeared.count(id) and not early.count(id)) {
+                pass_through += sizes[id];
+            }
+        }
+
+        if (code.empty()) {
+            return nullptr;
+        }
+        auto schedule = Schedule::fromJson(window, name).first;
+        for (auto &item: local) {
+            schedule->common->operands[item.second]->id = item.first;
+        }
+        return schedule;
+    }
+
+    // Search the carried window together with the new one, emit up to the first task of the new one and carry the rest,
+    // so re-computation may regenerate operands of the emitted part
+    void flush(std::vector<nlohmann::json> &items, std::ofstream &file, bool last) {
+        if (carried.empty() and not last) {
+            carried.swap(items);
+            return;
+        }
+        int carried_size = carried.size();
+        std::move(items.begin(), items.end(), std::back_inserter(carried));
+        items.clear();
+        if (carried.empty()) {
+            return;
+        }
+
+        // Optimize
+        std::vector<nlohmann::json> code;
+        std::vector<int> positions;
+        std::set<int> appeared, early;
+        size_t pass_through;
+        auto schedule = load(carried, "window " + std::to_string(windows), code, positions, appeared, early, pass_through);
+        schedule->analyze();
+        origin_peak_memory = std::max(origin_peak_memory, schedule->peak_memory + pass_through);
+        auto result = Optimizer(limit > pass_through ? limit - pass_through : 0, inplace).search(schedule, false);
+        auto &best = result.best;
+        searched += result.count;
+        ++ windows;
+        best->common->restore(best->head);
+        if (not best->common->check(best->head)) {
+            error("Check failed while emitting window %d.\n", windows);
+        }
+
+        // The first task of the new window (with the views created for it) starts the carried part
+        TaskHandle boundary;
+        LOOP(task, best->head) {
+            if (not last and task->id > 0 and not task->isDealloc() and not task->isShare() and positions[task->id - 1] >= carried_size) {
+                boundary = task;
+                while (boundary->prev and boundary->prev->isShare()) {
+                    boundary = boundary->prev;
+                }
+                break;
+            }
+        }
+
+        // Split into the emitted part and the carried part, carried tasks go back to items with their costs
+        std::vector<nlohmann::json> emitting, prefix, rest;
+        auto item = [&code](const TaskHandle &task, const nlohmann::json &json) {
+            if (task->id > 0 and not task->isDealloc() and not task->isShare()) {
+                auto item = code[task->id - 1];
+                item["ins"] = json["ins"], item["outs"] = json["outs"];
+                return item;
+            }
+            auto item = json;
+            item["workspace"] = item["time"] = 0;
+            return item;
+        };
+        if (not early.empty()) {
+            auto dealloc = Task::dealloc({});
+            auto json = dealloc->toJson();
+            json["outs"] = nlohmann::json(std::vector<int>(early.begin(), early.end()));
+            emitting.push_back(json);
+            prefix.push_back(item(dealloc, json));
+        }
+        bool carrying = false;
+        LOOP(task, best->head) {
+            carrying = carrying or task == boundary;
+            auto json = task->toJson();
+            (carrying ? rest : prefix).push_back(item(task, json));
+            if (not carrying) {
+                emitting.push_back(json);
+            }
+        }
+        carried.swap(rest);
+
+        // Analyze and emit the finalized part, then move the boundary
+        code.clear(), positions.clear(), appeared.clear(), early.clear();
+        auto finalized = load(prefix, "window " + std::to_string(windows), code, positions, appeared, early, pass_through);
+        if (finalized) {
+            finalized->analyze();
+            peak_memory = std::max(peak_memory, finalized->peak_memory + pass_through);
+            total_time += finalized->total_time;
+        }
+        for (auto &json: emitting) {
+            file << (emitted ? ",\n" : "") << json.dump();
+            emitted = true;
+        }
+        for (int id: early) {
+            live.erase(id);
+        }
+        for (int id: appeared) {
+            live.erase(id);
+        }
+        if (finalized) {
+            for (auto &operand: finalized->common->not_dealloc) {
+                live.insert(operand->id);
+            }
+        }
+    }
+
+public:
+    Streamer(size_t limit, int window_size, bool inplace=false): limit(limit), window_size(window_size), inplace(inplace) {}
+
+    void run(const std::string &input, const std::string &output) {
+        printf("Streaming case %s with window size %d (limit %s) ... \n", input.c_str(), window_size, prettyBytes(limit).c_str());
+        Timer timer;
+
+        // The first pass only keeps operand sizes
+        auto json = parse(input, "data", [this](nlohmann::json &item) {
+            int id = item["id"];
+            if (id >= static_cast<int>(sizes.size())) {
+                sizes.resize(id + 1);
+            }
+            sizes[id] = item["size"];
+        });
+        inputs = json["inputs"], outputs = json["outputs"], version = json["version"];
+
+        // The second pass optimizes and emits window by window
+        std::ofstream file(output);
+        file << "{\"code\": [\n";
+        std::vector<nlohmann::json> items;
+        parse(input, "code", [&items, &file, this](nlohmann::json &item) {
+            items.push_back(std::move(item));
+            ++ count;
+            if (static_cast<int>(items.size()) == window_size) {
+                flush(items, file, false);
+            }
+        });
+        flush(items, file, true);
+
+        // The last pass copies the operand table
+        bool first = true;
+        file << "\n], \"data\": [\n";
+        parse(input, "data", [&file, &first](nlohmann::json &item) {
+            item.erase("size");
+            file << (first ? "" : ",\n") << item.dump();
+            first = false;
+        });
+        file << "\n], \"inputs\": " << inputs.dump() << ", \"outputs\": " << outputs.dump() << ", \"version\": " << version.dump() << "}" << std::endl;
+
+        printf(" > Result:\n");
+        printf("   > Windows searched: %d (%d operators)\n", windows, count);
+        printf("   > Schedules searched: %d\n", searched);
+        printf("   > Time used: %s\n", prettyNanoseconds(timer.tik()).c_str());
+        printf("   > Best: {peak memory: %s, total time: %s}\n", prettyBytes(peak_memory).c_str(), prettyNanoseconds(total_time).c_str());
+        printf("   > Satisfy memory: %s\n", peak_memory <= limit ? "true" : "false");
+        printf(" > Result written into path %s\n", output.c_str());
+        if (peak_memory > limit and peak_memory >= origin_peak_memory) {
+            warning("Streaming did not improve the peak memory %s, re-computation only reaches the previous window, try a larger window\n",
+                    prettyBytes(origin_peak_memory).c_str());
+        }
+    }
+};
@@ -1,9 +1,17 @@
 #pragma once
 
+#include <algorithm>
+#include <atomic>
 #include <cstdio>
 #include <cstdarg>
 #include <cctype>
+#include <cmath>
+#include <functional>
 #include <random>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
 
 std::string pretty(size_t value, size_t scale, const char* *units, int m) {
     int count = 0;
@@ -29,6 +37,15 @@ std::string prettyNanoseconds(uint64_t duration) {
 }
 
 void error(const char *fmt, ...) {
+#ifdef DLMO_LIBRARY
+    // Embedded runs hand errors back to the caller instead of exiting
+    char buffer[1024];
+    va_list args;
+    va_start(args, fmt);
+    vsnprintf(buffer, sizeof(buffer), fmt, args);
+    va_end(args);
+    throw std::runtime_error(buffer);
+#else
     fprintf(stderr, "\033[31mError: ");
 
     va_list args;
@@ -39,6 +56,7 @@ void error(const char *fmt, ...) {
     fprintf(stderr, "\033[0m");
     fflush(stderr);
     std::exit(EXIT_FAILURE);
+#endif
 }
 
 void warning(const char *fmt, ...) {
@@ -53,6 +71,26 @@ void warning(const char *fmt, ...) {
     fflush(stderr);
 }
 
+// Drops the message, for failures the caller only checks by the result
+void silent(const char*, ...) {}
+
+// Standard score of the `p`-th quantile (0 < p < 1) of the standard normal distribution
+double normalQuantile(double p) {
+    if (p <= 0 or p >= 1) {
+        error("Quantile should be in (0, 1)\n");
+    }
+    double low = -10, high = 10;
+    for (int i = 0; i < 100; ++ i) {
+        double mid = (low + high) / 2;
+        if (0.5 * std::erfc(-mid / std::sqrt(2.0)) < p) {
+            low = mid;
+        } else {
+            high = mid;
+        }
+    }
+    return (low + high) / 2;
+}
+
 class Unit {
 public:
     template<typename T>
@@ -134,5 +172,31 @@ public:
     }
 };
 
+// Run `body(i)` for every i in [0, count), `body(0)` on the calling thread and the others on their own. Extra threads
+// of all calls (e.g. analyses inside concurrent segment searches) are bounded by the count of cores, a call which
+// would exceed it runs the bodies one by one instead
+void parallelFor(int count, const std::function<void(int)> &body) {
+    static std::atomic<int> running(0);
+    int extra = count - 1, cores = std::max<int>(std::thread::hardware_concurrency(), 1);
+    if (extra <= 0 or running.fetch_add(extra) + extra >= cores) {
+        if (extra > 0) {
+            running -= extra;
+        }
+        for (int i = 0; i < count; ++ i) {
+            body(i);
+        }
+        return;
+    }
+    std::vector<std::thread> threads;
+    for (int i = 1; i < count; ++ i) {
+        threads.emplace_back(body, i);
+    }
+    body(0);
+    for (auto &thread: threads) {
+        thread.join();
+    }
+    running -= extra;
+}
+
 #define LOOP(var, list_head) for (auto (var) = (list_head); (var); (var) = (var)->next)
 #define LOOP_BACK(var, list_tail) for (auto (var) = (list_tail); (var); (var) = (var)->prev)
\ No newline at end of file
@@ -0,0 +1,260 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <functional>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include "json.hpp"
+#include "reader.hpp"
+#include "timer.hpp"
+#include "utils.hpp"
+
+// A program in the IR format, executed symbolically over value hashes
+struct Trace {
+    struct Entry {
+        std::string name;
+        bool dealloc = false, share = false;
+
+        // Micro-tasks of a split operator before the last one, whose outputs are incomplete
+        bool partial = false;
+        size_t signature = 0;
+        std::vector<int> ins, outs;
+        std::vector<size_t> in_values, values;
+    };
+
+    std::vector<Entry> entries;
+
+    // Values on device after the last entry
+    std::unordered_map<int, size_t> final;
+
+    // Values computed by operators (not `.share`), and also initial values read
+    std::unordered_set<size_t> computed, known;
+
+    // Presence violations found while executing, with their positions
+    std::vector<std::pair<int, std::string>> violations;
+
+    // Operands read before being generated hold their initial values
+    static size_t initial(int id) {
+        return 0x9e3779b97f4a7c15ull ^ static_cast<size_t>(id);
+    }
+
+    static Trace fromJson(const nlohmann::json &json) {
+        Trace trace;
+        std::hash<std::string> hasher;
+        for (auto &item: json["code"]) {
+            Entry entry;
+            entry.name = item["name"];
+            entry.dealloc = entry.name == ".dealloc";
+            entry.share = entry.name == ".share";
+            auto attr = item.count("attr") ? item["attr"] : nlohmann::json();
+            if (attr.is_object() and attr.count("split")) {
+                entry.partial = attr["split"]["index"].get<int>() + 1 < attr["split"]["count"].get<int>();
+                attr.erase("split");
+            }
+            entry.signature = hasher(entry.name + (item.count("attr") ? attr.dump() : ""));
+            for (auto &id: item["ins"]) {
+                entry.ins.push_back(id);
+            }
+            for (auto &id: item["outs"]) {
+                entry.outs.push_back(id);
+            }
+            trace.entries.push_back(std::move(entry));
+        }
+        return trace;
+    }
+
+    // The recurrence of versions in `Common::analyzeTopology`, seeded by the operator and keyed by the output position,
+    // so renamed (in-place) outputs keep their values
+    void execute() {
+        std::unordered_map<int, size_t> value;
+        std::unordered_set<int> freed;
+        for (int i = 0; i < entries.size(); ++ i) {
+            auto &entry = entries[i];
+            auto fail = [this, i, &entry](const std::string &what, int id) {
+                violations.emplace_back(i, entry.name + " " + what + " operand " + std::to_string(id));
+            };
+            if (entry.dealloc) {
+                for (int id: entry.outs) {
+                    if (not value.count(id)) {
+                        fail("frees the absent", id);
+                    }
+                    value.erase(id);
+                    freed.insert(id);
+                }
+                continue;
+            }
+            size_t hash = entry.signature;
+            for (int id: entry.ins) {
+                if (not value.count(id)) {
+                    if (freed.count(id)) {
+                        fail("reads the freed", id);
+                    }
+                    value[id] = initial(id);
+                    known.insert(value[id]);
+                }
+                entry.in_values.push_back(value[id]);
+                hash = hash * 131ull + value[id];
+            }
+            for (int k = 0; k < entry.outs.size(); ++ k) {
+                if (entry.partial) {
+                    value.emplace(entry.outs[k], ~(hash * 131ull + k));
+                    freed.erase(entry.outs[k]);
+                    continue;
+                }
+                size_t version = entry.share ? value[entry.ins[0]] : hash * 131ull + k;
+                value[entry.outs[k]] = version;
+                freed.erase(entry.outs[k]);
+                entry.values.push_back(version);
+                if (not entry.share) {
+                    computed.insert(version);
+                    known.insert(version);
+                }
+            }
+        }
+        final = value;
+    }
+};
+
+struct Validation {
+    int entries = 0, dependent = 0;
+    uint64_t used_time = 0;
+    std::vector<std::string> violations;
+
+    bool passed() const {
+        return violations.empty();
+    }
+};
+
+// Checks that an optimized program computes the same values as the original one
+class Validator {
+    int threads;
+
+    // Run `check` on `count` positions split into contiguous chunks, violations are kept in order
+    void partitioned(int count, const std::function<void(int, std::vector<std::string>&)> &check,
+                     std::vector<std::string> &violations) const {
+        int chunks = std::max(1, std::min(threads, count));
+        std::vector<std::vector<std::string>> found(chunks);
+        std::vector<std::thread> workers;
+        for (int c = 0; c < chunks; ++ c) {
+            workers.emplace_back([&, c]() {
+                int begin = static_cast<long long>(count) * c / chunks, end = static_cast<long long>(count) * (c + 1) / chunks;
+                for (int i = begin; i < end; ++ i) {
+                    check(i, found[c]);
+                }
+            });
+        }
+        for (auto &worker: workers) {
+            worker.join();
+        }
+        for (auto &items: found) {
+            violations.insert(violations.end(), items.begin(), items.end());
+        }
+    }
+
+public:
+    explicit Validator(int threads=std::thread::hardware_concurrency()): threads(std::max(threads, 1)) {}
+
+    Validation validate(const nlohmann::json &origin_json, const nlohmann::json &optimized_json) const {
+        Timer timer;
+        Validation validation;
+
+        // Both programs are executed concurrently, each execution only propagates hashes
+        Trace origin = Trace::fromJson(origin_json), optimized = Trace::fromJson(optimized_json);
+        std::thread executor([&origin]() { origin.execute(); });
+        optimized.execute();
+        executor.join();
+        validation.entries = optimized.entries.size();
+        for (auto &violation: origin.violations) {
+            validation.violations.push_back("Original #" + std::to_string(violation.first) + ": " + violation.second);
+        }
+        for (auto &violation: optimized.violations) {
+            validation.violations.push_back("Optimized #" + std::to_string(violation.first) + ": " + violation.second);
+        }
+
+        // Every operator reads the versions its original instance reads, operators reading wrong versions only
+        // because of earlier violations are counted as dependent
+        std::atomic<int> dependent(0);
+        partitioned(optimized.entries.size(), [&](int i, std::vector<std::string> &found) {
+            auto &entry = optimized.entries[i];
+            if (entry.dealloc or entry.share or entry.partial or entry.values.empty() or origin.computed.count(entry.values[0])) {
+                return;
+            }
+            for (size_t version: entry.in_values) {
+                if (not origin.known.count(version)) {
+                    ++ dependent;
+                    return;
+                }
+            }
+            std::string ins;
+            for (int id: entry.ins) {
+                ins += " " + std::to_string(id);
+            }
+            found.push_back("Optimized #" + std::to_string(i) + ": " + entry.name + " reads versions never read by it in the original (ins:" + ins + ")");
+        }, validation.violations);
+
+        // Every original value is computed
+        partitioned(origin.entries.size(), [&](int i, std::vector<std::string> &found) {
+            auto &entry = origin.entries[i];
+            if (entry.dealloc or entry.share or entry.partial) {
+                return;
+            }
+            for (size_t version: entry.values) {
+                if (not optimized.computed.count(version)) {
+                    for (size_t in_version: entry.in_values) {
+                        if (not optimized.known.count(in_version)) {
+                            ++ dependent;
+                            return;
+                        }
+                    }
+                    found.push_back("Original #" + std::to_string(i) + ": " + entry.name + " is never computed with the same inputs");
+                    return;
+                }
+            }
+        }, validation.violations);
+        validation.dependent = dependent;
+
+        // Final operands hold the same values
+        std::vector<int> finals;
+        for (auto &item: origin.final) {
+            finals.push_back(item.first);
+        }
+        for (auto &item: optimized.final) {
+            if (not origin.final.count(item.first)) {
+                finals.push_back(item.first);
+            }
+        }
+        std::sort(finals.begin(), finals.end());
+        for (int id: finals) {
+            auto origin_it = origin.final.find(id), optimized_it = optimized.final.find(id);
+            if (origin_it == origin.final.end()) {
+                validation.violations.push_back("Operand " + std::to_string(id) + " is never deallocated");
+            } else if (optimized_it == optimized.final.end()) {
+                validation.violations.push_back("Operand " + std::to_string(id) + " is deallocated but should be kept");
+            } else if (not origin.known.count(optimized_it->second)) {
+                ++ validation.dependent;
+            } else if (origin_it->second != optimized_it->second) {
+                validation.violations.push_back("Operand " + std::to_string(id) + " ends with a different version");
+            }
+        }
+        validation.used_time = timer.tik();
+        return validation;
+    }
+
+    Validation validateFiles(const std::string &origin_path, const std::string &optimized_path) const {
+        return validate(PatternReader::fromFile(origin_path), PatternReader::fromFile(optimized_path));
+    }
+
+    static void report(const Validation &validation) {
+        for (auto &violation: validation.violations) {
+            printf("   > %s\n", violation.c_str());
+        }
+        printf(" > Validated %d entries in %s: %s (%zu violations, %d dependent operators)\n", validation.entries,
+               prettyNanoseconds(validation.used_time).c_str(), validation.passed() ? "passed" : "failed",
+               validation.violations.size(), validation.dependent);
+    }
+};